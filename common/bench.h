@@ -0,0 +1,30 @@
+/* microbenchmarks, shared by both servers' bench.c */
+/* every result is one line "name ops ns/op ops/s", so two runs */
+/* can be compared with diff, awk or a spreadsheet */
+#ifndef BENCH_H
+#define BENCH_H
+
+#include <stdio.h>	// standard input/output
+#include <time.h>	// for clock_gettime
+
+/* monotonic clock in nanoseconds */
+static inline long bench_ns(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+static inline void bench_header(void) {
+	printf("# %-22s %10s %10s %12s\n", "name", "ops", "ns/op", "ops/s");
+}
+
+/* ops operations took ns nanoseconds */
+static inline void bench_report(const char *name, long ops, long ns) {
+	if (ns < 1) ns = 1;
+	printf("%-24s %10ld %10.1f %12.0f\n", name, ops,
+		(double) ns / ops, ops * 1e9 / ns);
+	fflush(stdout);
+}
+
+#endif
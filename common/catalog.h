@@ -0,0 +1,234 @@
+/* resource catalog, shared by both servers */
+/* resources are numbered 0..n-1 in the order of the catalog file, */
+/* names are found through an open addressing table built once at */
+/* startup, so a lookup costs the same with 6 or 4000 resources */
+#ifndef CATALOG_H
+#define CATALOG_H
+
+#include <stdio.h>	// standard input/output
+#include <stdlib.h>	// general purpose functions
+#include <string.h>	// string operations
+#include <ctype.h>	// character classes
+
+#define MAXRES 4096		// max resource types
+#define RESNAME 16		// max resource name, \0 included
+#define MAXITEMS 256		// max lines of a request
+
+typedef struct catalog_t {	// every resource of the game
+	int n;			// resource types
+	char (*name)[RESNAME];	// names, by id
+	unsigned *hash;		// hash of each name, by id
+	int *slot;		// hash table of ids, -1 = empty
+	unsigned mask;		// hash table size - 1
+} catalog_t;
+
+typedef struct request_t {	// resources asked by a player
+	int n;			// lines of the request
+	struct item_t {
+		int id;		// resource
+		int num;	// amount
+	} item[MAXITEMS];
+} request_t;
+
+/* the catalog when none is given */
+static const char *catalog_default[] = { "gold", "armor", "ammo", "lumber", "magic", "rock" };
+
+/* FNV-1a of the len bytes at s */
+static inline unsigned catalog_hash(const char *s, size_t len) {
+	unsigned h = 2166136261u;
+
+	while (len--) {
+		h = (h ^ (unsigned char) *s++) * 16777619u;
+	}
+	return h;
+}
+
+/* returns the resource's id, or -1 if it is not in the catalog */
+/* name is the len bytes at name, straight from a request */
+static inline int catalog_find(const catalog_t *c, const char *name, size_t len) {
+	unsigned h, i;
+	int id;
+
+	if (len >= RESNAME) {
+		return -1;	// no such long names
+	}
+	h = catalog_hash(name, len);
+	for (i = h & c->mask; (id = c->slot[i]) != -1; i = (i+1) & c->mask) {
+		if (c->hash[id] == h && !memcmp(c->name[id], name, len) && !c->name[id][len]) {
+			return id;
+		}
+	}
+	return -1;
+}
+
+/* reads the player's name (cut to max bytes, \0 included) and the */
+/* requested resources from request in place: no copy, no strtok, */
+/* nothing shared, so many players are parsed at once, and the */
+/* request may be as long as a frame, no amount counts above quota */
+/* returns 1 if the request is well formed, 0 otherwise */
+static inline int catalog_parse(const catalog_t *c, int quota, const char *request, size_t len,
+		char *name, size_t max, request_t *req, int *sum) {
+	const char *p = request, *end = request + len;	// next byte, end
+	const char *word;	// resource's name
+	size_t n;		// its length
+	int i, num;		// its id and amount
+
+	req->n = 0;		// nothing asked yet
+
+	/* first word is player's name, the rest of its line is ignored */
+	while (p < end && isspace((unsigned char) *p)) p++;
+	for (word = p; p < end && !isspace((unsigned char) *p); p++);
+	if (p == word) {
+		return 0;	// no name
+	}
+	n = (size_t) (p - word) < max ? (size_t) (p - word) : max - 1;	// long names are cut
+	memcpy(name, word, n);
+	name[n] = 0;
+	while (p < end && *p != '\n') p++;
+
+	/* then one "resource amount" per line */
+	while (p < end) {
+		while (p < end && isspace((unsigned char) *p)) p++;	// blank lines
+		if (p == end) {
+			break;	// EOF
+		}
+		for (word = p; p < end && !isspace((unsigned char) *p); p++);
+		n = p - word;
+		while (p < end && (*p == ' ' || *p == '\t')) p++;
+		if (p == end || !isdigit((unsigned char) *p)) {
+			return 0;	// bad file, no amount
+		}
+		for (num = 0; p < end && isdigit((unsigned char) *p); p++) {
+			num = num * 10 + *p - '0';
+			if (num > quota) {
+				num = quota + 1;	// too greedy anyway
+			}
+		}
+		while (p < end && *p != '\n' && isspace((unsigned char) *p)) p++;
+		if (p < end && *p != '\n') {
+			return 0;	// bad file, more than an amount
+		}
+		if (((i = catalog_find(c, word, n)) < 0) || (num <= 0) ||
+				req->n == MAXITEMS) {
+			return 0;	// invalid resource or invalid number
+		}
+		req->item[req->n].id = i;	// player's request
+		req->item[req->n++].num = num;
+		if ((*sum += num) > quota) {	// total resources
+			return 0;	// too greedy, no need to read on
+		}
+	}	// EOF
+
+	return 1;
+}
+
+/* gives back the first n items of a request to an inventory */
+static inline void catalog_release(int *inv, const request_t *req, int n) {
+	int i;
+
+	for (i=0; i<n; i++) {
+		__atomic_add_fetch(&inv[req->item[i].id], req->item[i].num, __ATOMIC_ACQ_REL);
+	}
+}
+
+/* takes every resource of the request from an inventory or none, */
+/* each one with a compare and swap, so concurrent players never */
+/* oversell an item (the inventory may be in shared memory) */
+static inline int catalog_reserve(int *inv, const request_t *req) {
+	int i, id, have;
+
+	for (i=0; i<req->n; i++) {
+		id = req->item[i].id;
+		have = __atomic_load_n(&inv[id], __ATOMIC_RELAXED);
+		do {
+			if (have - req->item[i].num < 0) {	// not enough left
+				catalog_release(inv, req, i);	// undo the taken ones
+				return 0;
+			}
+		} while (!__atomic_compare_exchange_n(&inv[id], &have, have - req->item[i].num,
+				1, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED));
+	}
+	return 1;
+}
+
+static inline int catalog_id(const catalog_t *c, const char *name) {
+	return catalog_find(c, name, strlen(name));
+}
+
+/* adds a resource, returns -1 if it is a duplicate or too long */
+/* the table is kept at most half full */
+static inline int catalog_add(catalog_t *c, const char *name) {
+	unsigned i, size;
+	int id;
+
+	if (strlen(name) >= RESNAME || c->n >= MAXRES || catalog_id(c, name) != -1) {
+		return -1;
+	}
+	id = c->n++;
+	strcpy(c->name[id], name);
+	c->hash[id] = catalog_hash(name, strlen(name));
+
+	if (2 * (unsigned) c->n > c->mask + 1) {	// grow and rehash
+		size = 2 * (c->mask + 1);
+		free(c->slot);
+		if (!(c->slot = malloc(size * sizeof(int)))) {
+			return -1;
+		}
+		memset(c->slot, -1, size * sizeof(int));
+		c->mask = size - 1;
+		for (id = 0; id < c->n; id++) {
+			for (i = c->hash[id] & c->mask; c->slot[i] != -1; i = (i+1) & c->mask);
+			c->slot[i] = id;
+		}
+	}
+	else {
+		for (i = c->hash[id] & c->mask; c->slot[i] != -1; i = (i+1) & c->mask);
+		c->slot[i] = id;
+	}
+	return id;
+}
+
+/* reads one resource name per line (the default six if fname is */
+/* NULL), returns -1 if the file is wrong */
+static inline int catalog_load(catalog_t *c, const char *fname) {
+	char word[64];		// one name
+	FILE *fp;
+	int i, ok = 0;
+
+	memset(c, 0, sizeof(catalog_t));
+	c->name = malloc(MAXRES * RESNAME);
+	c->hash = malloc(MAXRES * sizeof(unsigned));
+	c->slot = malloc(8 * sizeof(int));
+	if (!c->name || !c->hash || !c->slot) {
+		return -1;
+	}
+	memset(c->slot, -1, 8 * sizeof(int));
+	c->mask = 7;
+
+	if (!fname) {
+		for (i = 0; i < (int) (sizeof(catalog_default) / sizeof(*catalog_default)); i++) {
+			catalog_add(c, catalog_default[i]);
+		}
+		return 0;
+	}
+	if (!(fp = fopen(fname, "r"))) {
+		return -1;
+	}
+	while (fscanf(fp, "%63s", word) == 1) {
+		if ((ok = catalog_add(c, word)) == -1) {
+			printf("Wrong catalog, resource %s\n", word);
+			break;
+		}
+	}
+	fclose(fp);
+	return ok == -1 || !c->n ? -1 : 0;
+}
+
+static inline void catalog_free(catalog_t *c) {
+	free(c->name);
+	free(c->hash);
+	free(c->slot);
+	memset(c, 0, sizeof(catalog_t));
+}
+
+#endif
@@ -0,0 +1,91 @@
+/* the players of a game, laid out the same way by both servers */
+/* a game record is one cache line aligned block, a game of up to */
+/* MAXPLAYERS players keeps its slots inline: the descriptors fill */
+/* a line of their own, so sending a message to the game reads */
+/* that line and the game's first one, which points to it, and no */
+/* other, the names follow and are only read by the stats socket */
+/* a bigger game keeps its slots in a block of their own, every */
+/* array of it starting on a line of its own (see slots_carve) */
+#ifndef GAME_H
+#define GAME_H
+
+#define CACHELINE 64		// bytes of a cache line
+#define MAXPLAYERS 16		// players of a game kept inline
+#define NAMELEN 16		// player's name, \0 included
+
+typedef struct roster_t {	// who plays in a game
+	int *fd;		// players' file descriptors, 0 = free slot
+	char (*name)[NAMELEN];	// players' names
+} roster_t;
+
+typedef struct slots_t {	// the roster of a small game, inline
+	int fd[MAXPLAYERS];	// players' file descriptors
+	char name[MAXPLAYERS][NAMELEN];	// players' names
+} __attribute__((aligned(CACHELINE))) slots_t;
+
+/* bytes of n entries of size bytes, whole cache lines */
+#define SLOTS_BYTES(n, size) \
+	(((n) * (size) + CACHELINE - 1) & ~(size_t) (CACHELINE - 1))
+
+/* bytes of a big game's roster of n players */
+#define ROSTER_BYTES(n) (SLOTS_BYTES(n, sizeof(int)) + SLOTS_BYTES(n, NAMELEN))
+
+/* the next array of a big game's block, n entries of size bytes */
+static inline void *slots_carve(char **block, int n, size_t size) {
+	void *p = *block;
+
+	*block += SLOTS_BYTES(n, size);
+	return p;
+}
+
+/* points the roster of a game of n players to the inline slots, */
+/* or to the first arrays of its block if n > MAXPLAYERS, block */
+/* then moves past them, to the server's own arrays */
+static inline void roster_place(roster_t *r, slots_t *small, char **block, int n) {
+	if (n <= MAXPLAYERS) {
+		r->fd = small->fd;
+		r->name = small->name;
+		return;
+	}
+	r->fd = (int *) slots_carve(block, n, sizeof(int));
+	r->name = (char (*)[NAMELEN]) slots_carve(block, n, NAMELEN);
+}
+
+/* bytes of a game record with n ints of inventory after it */
+#define GAME_SIZE(record, n) \
+	((sizeof(record) + (n) * sizeof(int) + CACHELINE - 1) & ~(size_t) (CACHELINE - 1))
+
+/* finished games wait to be reused on a stack: the game number in */
+/* the low 32 bits of the head, a tag above it that every push and */
+/* pop bumps, so a slow pop never takes a game that was popped and */
+/* pushed back meanwhile, a game links to the next one through its */
+/* next_free, link(n) is where game n keeps it */
+/* returns the game taken, 0 if none has finished */
+static inline int game_pop(unsigned long *list, int *(*link)(int)) {
+	unsigned long head, next;
+	int n;
+
+	head = __atomic_load_n(list, __ATOMIC_ACQUIRE);
+	while ((n = head & 0xffffffff)) {
+		next = ((head >> 32) + 1) << 32 | (unsigned) __atomic_load_n(link(n), __ATOMIC_RELAXED);
+		if (__atomic_compare_exchange_n(list, &head, next,
+				1, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+			break;
+		}
+	}
+	return n;
+}
+
+/* game n, whose next_free is at link, waits to be reused */
+static inline void game_push(unsigned long *list, int *link, int n) {
+	unsigned long head, next;
+
+	head = __atomic_load_n(list, __ATOMIC_RELAXED);
+	do {
+		__atomic_store_n(link, (int) (head & 0xffffffff), __ATOMIC_RELAXED);
+		next = ((head >> 32) + 1) << 32 | (unsigned) n;
+	} while (!__atomic_compare_exchange_n(list, &head, next,
+			1, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED));
+}
+
+#endif
@@ -0,0 +1,176 @@
+/* chat history, shared by both servers */
+/* every game keeps its last HISTORY chat messages in a ring, a */
+/* player who drops out of a running game and joins again with */
+/* the same name gets the seat back and the last -m of them in */
+/* one write, SEATS remembers where such players sat */
+/* with -l a background flusher appends every message to a log */
+/* file through a mapping, senders never touch it, so chat never */
+/* waits for the disk, a line per message: */
+/* "game <n>: <name> : <text>" */
+#ifndef HISTORY_H
+#define HISTORY_H
+
+#include <string.h>	// string operations
+#include <unistd.h>	// miscellaneous functions
+#include <fcntl.h>	// file control options
+#include <sys/mman.h>	// maps the log
+#include <sys/stat.h>	// for the log's size
+#include <stdio.h>	// for snprintf
+#include "proto.h"	// framed messages
+#include "catalog.h"	// for catalog_hash
+#include "game.h"	// for NAMELEN
+
+#define HISTORY 64		// max chat messages kept per game
+#define SEATS 4096		// players who left a running game
+#define SEATPROBE 8		// seats a name may sit in
+#define FLUSH 100		// ms between the flusher's passes
+#define LOGWINDOW (1 << 20)	// bytes of the log mapped at once
+
+/* a seat is the name of a player who left, the game number and */
+/* its round, a name looks at SEATPROBE seats from its hash and */
+/* only ever matches its own, when they are all taken the one */
+/* left longest ago is given up, the game has the last word on */
+/* the slot, callers hold the seats' lock */
+typedef struct seat_t {
+	char name[NAMELEN];	// who left, "" = free
+	unsigned long game;	// round << 32 | game number
+	long left;		// when, the oldest is given up first
+} seat_t;
+
+static inline void history_keep(seat_t *seats, const char *name, unsigned long game, long now) {
+	unsigned h = catalog_hash(name, strnlen(name, NAMELEN));
+	seat_t *s, *pick = NULL;	// the name's own, or a free or the oldest one
+	int i;
+
+	for (i=0; i<SEATPROBE; i++) {
+		s = &seats[(h + i) % SEATS];
+		if (!strncmp(s->name, name, NAMELEN)) {
+			pick = s;
+			break;
+		}
+		if (!pick || (pick->name[0] && (!s->name[0] || s->left < pick->left))) {
+			pick = s;
+		}
+	}
+	strncpy(pick->name, name, NAMELEN - 1);
+	pick->name[NAMELEN - 1] = '\0';	// a name too long is cut
+	pick->game = game;
+	pick->left = now;
+}
+
+/* the player's seat, given up as he takes it, 0 = none */
+static inline unsigned long history_take(seat_t *seats, const char *name) {
+	unsigned h = catalog_hash(name, strnlen(name, NAMELEN));
+	seat_t *s;
+	int i;
+
+	for (i=0; i<SEATPROBE; i++) {
+		s = &seats[(h + i) % SEATS];
+		if (s->name[0] && !strncmp(s->name, name, NAMELEN)) {
+			s->name[0] = '\0';
+			return s->game;
+		}
+	}
+	return 0;
+}
+
+typedef struct hlog_t {	// append-only log, mapped a window at a time
+	int fd;			// the file
+	char *map;		// its window
+	off_t base;		// file offset of the window
+	size_t used;		// bytes written in the window
+} hlog_t;
+
+/* the file grows a window at a time, the kernel writes the */
+/* pages back, returns -1 with errno set */
+static inline int hlog_map(hlog_t *l) {
+	if (ftruncate(l->fd, l->base + LOGWINDOW) == -1) {
+		return -1;
+	}
+	l->map = mmap(NULL, LOGWINDOW, PROT_READ | PROT_WRITE, MAP_SHARED, l->fd, l->base);
+	return l->map == MAP_FAILED ? -1 : 0;
+}
+
+/* appends to an existing log, a server that died left the zeros */
+/* of its last window, they are written over */
+static inline int hlog_open(hlog_t *l, const char *path) {
+	struct stat st;
+
+	if ((l->fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644)) == -1) {
+		return -1;
+	}
+	if (fstat(l->fd, &st) == -1) {
+		close(l->fd);
+		return -1;
+	}
+	l->base = st.st_size ? (st.st_size - 1) & ~(off_t) (LOGWINDOW - 1) : 0;
+	l->used = st.st_size - l->base;
+	if (hlog_map(l) == -1) {
+		close(l->fd);
+		return -1;
+	}
+	while (l->used && !l->map[l->used - 1]) {
+		l->used--;
+	}
+	return 0;
+}
+
+/* lines may cross windows, the log has no holes */
+static inline int hlog_write(hlog_t *l, const char *buf, size_t len) {
+	size_t n;
+
+	while (len) {
+		n = len < LOGWINDOW - l->used ? len : LOGWINDOW - l->used;
+		memcpy(l->map + l->used, buf, n);
+		l->used += n;
+		buf += n;
+		len -= n;
+		if (l->used == LOGWINDOW) {	// next window
+			munmap(l->map, LOGWINDOW);
+			l->base += LOGWINDOW;
+			l->used = 0;
+			if (hlog_map(l) == -1) {
+				return -1;
+			}
+		}
+	}
+	return 0;
+}
+
+/* one chat message of game n */
+static inline int hlog_append(hlog_t *l, int n, const char *frame, size_t len) {
+	char line[32 + MAXCHAT + 1];	// game, text and newline
+	int k;
+
+	if (len < PROTO_HDR) {
+		return 0;
+	}
+	len -= PROTO_HDR;
+	k = snprintf(line, 32, "game %d: ", n);
+	memcpy(line + k, frame + PROTO_HDR, len);
+	k += len;
+	if (!len || line[k-1] != '\n') {
+		line[k++] = '\n';
+	}
+	return hlog_write(l, line, k);
+}
+
+/* messages of game n that went before the flusher came by */
+static inline int hlog_lost(hlog_t *l, int n, unsigned long lost) {
+	char line[64];
+	int k;
+
+	k = snprintf(line, sizeof(line), "game %d: %lu messages not logged\n", n, lost);
+	return hlog_write(l, line, k);
+}
+
+/* the zeros after the last line go, the mapping goes with the */
+/* process */
+static inline void hlog_close(hlog_t *l) {
+	if (ftruncate(l->fd, l->base + l->used) == -1) {
+		perror("ftruncate()\nerrno");	// the zeros stay
+	}
+	close(l->fd);
+}
+
+#endif
@@ -0,0 +1,135 @@
+/* TCP next to the Unix domain sockets, shared by servers and clients */
+/* a server name with a ':' is "host:port" and means TCP, anything */
+/* else is the path of a Unix domain socket */
+#ifndef NET_H
+#define NET_H
+
+#include <stdio.h>	// standard input/output
+#include <stdlib.h>	// general purpose functions
+#include <string.h>	// string operations
+#include <unistd.h>	// miscellaneous functions
+#include <errno.h>	// for the errno variable
+#include <sys/socket.h>	// socket definitions
+#include <sys/un.h>	// for sockaddr_un structure
+#include <netdb.h>	// for getaddrinfo
+#include <netinet/in.h>	// internet addresses
+#include <netinet/tcp.h>	// for TCP_NODELAY
+
+#define TCPBUF (256 * 1024)	// socket buffers of TCP players
+
+static inline int net_is_tcp(const char *name) {
+	return strchr(name, ':') != NULL;
+}
+
+/* chat messages are small, Nagle would hold them back */
+static inline void tcp_nodelay(int fd) {
+	int one = 1;
+
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+}
+
+/* bigger buffers for fast networks, set before listen or connect */
+/* so the window scale is agreed on with them */
+static inline void tcp_buffers(int fd) {
+	int size = TCPBUF;
+
+	setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+	setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+}
+
+/* "host:port", ":port" or "port" (host may be [ipv6]) */
+static inline struct addrinfo *net_resolve(const char *name, int passive) {
+	struct addrinfo hints, *res;
+	const char *colon = strrchr(name, ':');
+	const char *port = colon ? colon + 1 : name;
+	char host[256];
+	size_t len = colon ? (size_t) (colon - name) : 0;
+
+	if (len >= sizeof(host)) {
+		return NULL;
+	}
+	if (len > 1 && name[0] == '[' && name[len-1] == ']') {
+		name++;		// [::1]:port
+		len -= 2;
+	}
+	memcpy(host, name, len);
+	host[len] = 0;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = passive ? AI_PASSIVE : 0;
+	if (getaddrinfo(len ? host : NULL, port, &hints, &res) != 0) {
+		return NULL;
+	}
+	return res;
+}
+
+/* listens on "[host:]port", every address if there is no host */
+/* returns the socket, or -1 with errno set */
+static inline int tcp_listen(const char *name, int backlog) {
+	struct addrinfo *res, *ai;
+	int fd = -1, one = 1;
+
+	if (!(res = net_resolve(name, 1))) {
+		errno = EINVAL;
+		return -1;
+	}
+	for (ai = res; ai; ai = ai->ai_next) {
+		if ((fd = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC, ai->ai_protocol)) == -1) {
+			continue;
+		}
+		setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+		tcp_buffers(fd);	// accepted sockets inherit them
+		if (bind(fd, ai->ai_addr, ai->ai_addrlen) == 0 && listen(fd, backlog) == 0) {
+			break;
+		}
+		close(fd);
+		fd = -1;
+	}
+	freeaddrinfo(res);
+	return fd;
+}
+
+/* connects to "host:port" over TCP, or to the Unix domain socket */
+/* at name, returns the socket, or -1 with errno set */
+static inline int net_connect(const char *name) {
+	struct sockaddr_un addr;	// Unix domain sockets
+	struct addrinfo *res, *ai;
+	int fd = -1;
+
+	if (!net_is_tcp(name)) {
+		memset(&addr, 0, sizeof(struct sockaddr_un));
+		addr.sun_family = AF_UNIX;
+		strncpy(addr.sun_path, name, sizeof(addr.sun_path) - 1);
+		if ((fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) == -1) {
+			return -1;
+		}
+		if (connect(fd, (struct sockaddr *) &addr, sizeof(struct sockaddr_un)) == -1) {
+			close(fd);
+			return -1;
+		}
+		return fd;
+	}
+
+	if (!(res = net_resolve(name, 0))) {
+		errno = EINVAL;
+		return -1;
+	}
+	for (ai = res; ai; ai = ai->ai_next) {
+		if ((fd = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC, ai->ai_protocol)) == -1) {
+			continue;
+		}
+		tcp_buffers(fd);
+		if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0) {
+			tcp_nodelay(fd);
+			break;
+		}
+		close(fd);
+		fd = -1;
+	}
+	freeaddrinfo(res);
+	return fd;
+}
+
+#endif
@@ -0,0 +1,87 @@
+/* lock profiling (-P), shared by both servers */
+/* every call site of a lock keeps how long it waited for it and */
+/* how long it held it, each thread (or worker) in its own */
+/* profile, so the profiling itself adds no contention */
+/* since[site] is when the caller took the site's lock, it is */
+/* kept by the caller, profiles may be shared but it may not */
+#ifndef PROF_H
+#define PROF_H
+
+#include "stats.h"	// histograms and clock
+
+#define PROF_SITES 8		// max call sites
+
+typedef struct prof_t {		// one thread's (or worker's) profile
+	int shared;		// written by many, atomics needed
+	histo_t wait[PROF_SITES];	// waits for the lock (ns)
+	histo_t hold[PROF_SITES];	// lock held (ns)
+} prof_t;
+
+/* histo_add without atomics, for the owner of a profile */
+static inline void histo_put(histo_t *h, long v) {
+	int b = v > 0 ? 64 - __builtin_clzl(v) : 0;
+
+	if (b >= HISTO) b = HISTO - 1;
+	h->n++;
+	h->total += v;
+	h->bucket[b]++;
+	if (v > h->max) h->max = v;
+}
+
+/* site took its lock at now, after waiting since t */
+static inline void prof_taken(prof_t *p, long *since, int site, long t, long now) {
+	if (p->shared) histo_add(&p->wait[site], now - t);
+	else histo_put(&p->wait[site], now - t);
+	since[site] = now;
+}
+
+/* site has its lock again, after waiting on a condition */
+static inline void prof_retaken(long *since, int site) {
+	since[site] = stats_ns();
+}
+
+/* site is about to release its lock */
+static inline void prof_released(prof_t *p, long *since, int site) {
+	long t = since[site];
+
+	if (!t) {
+		return;		// taken before the profile was
+	}
+	if (p->shared) histo_add(&p->hold[site], stats_ns() - t);
+	else histo_put(&p->hold[site], stats_ns() - t);
+	since[site] = 0;
+}
+
+/* adds h to sum, h may be being written */
+static inline void histo_merge(histo_t *sum, const histo_t *h) {
+	int b;
+
+	sum->n += h->n;
+	sum->total += h->total;
+	if (h->max > sum->max) sum->max = h->max;
+	for (b = 0; b < HISTO; b++) {
+		sum->bucket[b] += h->bucket[b];
+	}
+}
+
+/* prof_<site>_wait_ns and prof_<site>_hold_ns of the n profiles */
+static inline void prof_print(int fd, const char **site, int nsites, prof_t **p, int n) {
+	histo_t wait, hold;
+	char name[64];
+	int i, s;
+
+	for (s = 0; s < nsites; s++) {
+		memset(&wait, 0, sizeof(wait));
+		memset(&hold, 0, sizeof(hold));
+		for (i = 0; i < n; i++) {
+			histo_merge(&wait, &p[i]->wait[s]);
+			histo_merge(&hold, &p[i]->hold[s]);
+		}
+		snprintf(name, sizeof(name), "prof_%s_wait_ns", site[s]);
+		histo_print(fd, name, &wait);
+		snprintf(name, sizeof(name), "prof_%s_hold_ns", site[s]);
+		histo_print(fd, name, &hold);
+	}
+}
+
+#endif
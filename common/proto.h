@@ -0,0 +1,186 @@
+/* framed wire protocol, shared by both servers and players */
+/* every message is a 4 byte header followed by its payload: */
+/* payload length (uint16) and message type (uint16), both big endian */
+/* so a stream may carry many messages per recv, or half of one */
+#ifndef PROTO_H
+#define PROTO_H
+
+#include <stdio.h>	// standard input/output
+#include <stdlib.h>	// general purpose functions
+#include <string.h>	// string operations
+#include <stdarg.h>	// variable arguments
+#include <errno.h>	// for the errno variable
+#include <poll.h>	// for the poll function
+#include <sys/types.h>	// various type definitions
+#include <sys/socket.h>	// socket definitions
+
+#define PROTO_HDR 4		// header size
+#define PROTO_MAX 65535		// max payload size
+#define PROTO_READ 4096		// min free space for each recv
+#define PROTO_STALL 1000	// ms to finish a frame already started
+#define MAXCHAT 1024		// max chat message, name included
+
+enum {			// message types
+	MSG_JOIN = 1,	// player: name and requested resources
+	MSG_OK,		// server: request approved
+	MSG_REJECT,	// server: request denied
+	MSG_WAIT,	// server: waiting for more players
+	MSG_START,	// server: game starts
+	MSG_CHAT	// both: chat message
+};
+
+typedef struct frames_t {	// reassembles frames of one stream
+	char *data;	// received bytes
+	size_t start;	// first byte not parsed yet
+	size_t len;	// received bytes in data
+	size_t size;	// allocated bytes
+} frames_t;
+
+/* writes the header and payload to frame, returns frame's length */
+static inline size_t proto_pack(char *frame, int type, const void *data, size_t len) {
+	frame[0] = len >> 8;
+	frame[1] = len;
+	frame[2] = type >> 8;
+	frame[3] = type;
+	memcpy(frame + PROTO_HDR, data, len);
+	return PROTO_HDR + len;
+}
+
+/* same, with a formatted payload of at most max bytes */
+/* frame must hold PROTO_HDR + max + 1 bytes (vsnprintf's \0) */
+static inline size_t proto_printf(char *frame, size_t max, int type, const char *fmt, ...) {
+	va_list ap;
+	int len;
+
+	va_start(ap, fmt);
+	len = vsnprintf(frame + PROTO_HDR, max + 1, fmt, ap);
+	va_end(ap);
+	if (len < 0) len = 0;
+	if ((size_t) len > max) len = max;	// truncated
+	frame[0] = len >> 8;
+	frame[1] = len;
+	frame[2] = type >> 8;
+	frame[3] = type;
+	return PROTO_HDR + len;
+}
+
+/* sends a whole frame or nothing, a frame cut in half would */
+/* break the stream, so once started it gets PROTO_STALL ms to */
+/* finish even on a non blocking socket, then the stream is shut */
+/* event loops must not wait for one player, they use proto_try */
+static inline int proto_write(int fd, const char *frame, size_t len, int flags) {
+	struct pollfd p = { fd, POLLOUT, 0 };
+	size_t done = 0;
+	ssize_t n;
+
+	while (done < len) {
+		n = send(fd, frame + done, len - done, flags | MSG_NOSIGNAL);
+		if (n > 0) {
+			done += n;
+		}
+		else if (n == -1 && errno == EINTR) {
+			continue;
+		}
+		else if (n == -1 && errno == EAGAIN && done &&
+				poll(&p, 1, PROTO_STALL) == 1) {
+			continue;	// room for the rest
+		}
+		else {
+			if (done) shutdown(fd, SHUT_RDWR);	// torn frame
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/* one non blocking try, for event loops: returns the bytes the */
+/* socket took, 0 if it is full, -1 if the player is gone, the */
+/* caller keeps the rest of the frame till the socket is writable */
+static inline ssize_t proto_try(int fd, const char *frame, size_t len) {
+	ssize_t n;
+
+	while ((n = send(fd, frame, len, MSG_DONTWAIT | MSG_NOSIGNAL)) == -1 && errno == EINTR);
+	if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+		return 0;
+	}
+	return n;
+}
+
+static inline int proto_send(int fd, int type, const void *data, size_t len, int flags) {
+	char small[PROTO_HDR + MAXCHAT], *frame = small;
+	int ret;
+
+	if (len > PROTO_MAX) {
+		errno = EMSGSIZE; return -1;
+	}
+	if (len > MAXCHAT && !(frame = malloc(PROTO_HDR + len))) {
+		return -1;
+	}
+	ret = proto_write(fd, frame, proto_pack(frame, type, data, len), flags);
+	if (frame != small) free(frame);
+	return ret;
+}
+
+/* one recv into the buffer, returns what recv returned */
+/* payloads from proto_next are valid till the next call */
+static inline ssize_t proto_read(int fd, frames_t *f) {
+	size_t size;
+	char *data;
+	ssize_t n;
+
+	if (f->start) {		// parsed frames are not needed anymore
+		memmove(f->data, f->data + f->start, f->len - f->start);
+		f->len -= f->start;
+		f->start = 0;
+	}
+	if (f->size - f->len < PROTO_READ) {	// grow, a frame may be big
+		size = f->size ? 2 * f->size : 2 * PROTO_READ;
+		if (!(data = realloc(f->data, size))) {
+			return -1;
+		}
+		f->data = data;
+		f->size = size;
+	}
+	if ((n = recv(fd, f->data + f->len, f->size - f->len, 0)) > 0) {
+		f->len += n;
+	}
+	return n;
+}
+
+/* takes the next complete frame, returns 0 if there is none yet */
+static inline int proto_next(frames_t *f, int *type, char **payload, size_t *len) {
+	unsigned char *h = (unsigned char *) f->data + f->start;
+	size_t n;
+
+	if (f->len - f->start < PROTO_HDR) {
+		return 0;	// no header yet
+	}
+	n = h[0] << 8 | h[1];
+	if (f->len - f->start < PROTO_HDR + n) {
+		return 0;	// no payload yet
+	}
+	*type = h[2] << 8 | h[3];
+	*payload = f->data + f->start + PROTO_HDR;
+	*len = n;
+	f->start += PROTO_HDR + n;
+	return 1;
+}
+
+/* blocks till the next frame, returns 0 if the stream ended */
+static inline int proto_recv(int fd, frames_t *f, int *type, char **payload, size_t *len) {
+	ssize_t n;
+
+	while (!proto_next(f, type, payload, len)) {
+		if ((n = proto_read(fd, f)) == 0 || (n == -1 && errno != EINTR)) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+static inline void proto_free(frames_t *f) {
+	free(f->data);
+	memset(f, 0, sizeof(frames_t));
+}
+
+#endif
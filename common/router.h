@@ -0,0 +1,113 @@
+/* the front door (router) and the gameservers behind it, shared */
+/* by the router and both servers: a backend (-u) connects to the */
+/* router's socket, the router passes it the descriptors of new */
+/* players (SCM_RIGHTS) and the backend reports its load back */
+/* every REPORT ms, the link is SOCK_SEQPACKET so every message, */
+/* whoever of the backend's processes sends or reads it, is whole */
+#ifndef ROUTER_H
+#define ROUTER_H
+
+#include <string.h>	// string operations
+#include <unistd.h>	// miscellaneous functions
+#include <errno.h>	// for the errno variable
+#include <sys/types.h>	// various type definitions
+#include <sys/socket.h>	// socket definitions
+#include <sys/un.h>	// for sockaddr_un structure
+
+#define REPORT 100		// ms between load reports
+
+typedef struct load_t {		// a backend's load report
+	pid_t pid;		// backend's process id
+	long routed;		// players the router handed it so far
+	long games;		// games with players now
+	long players;		// players in games now
+	long inventory;		// resources left in the games being filled
+} load_t;
+
+/* a backend connects to the router's socket at path */
+/* returns the link, or -1 with errno set */
+static inline int router_link(const char *path) {
+	struct sockaddr_un addr;	// Unix domain sockets
+	int fd;
+
+	memset(&addr, 0, sizeof(struct sockaddr_un));
+	addr.sun_family = AF_UNIX;
+	strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+	if ((fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0)) == -1) {
+		return -1;
+	}
+	if (connect(fd, (struct sockaddr *) &addr, sizeof(struct sockaddr_un)) == -1) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+/* the router passes a player to a backend, never blocking */
+/* returns -1 if the backend can not take him now */
+static inline int router_send_fd(int link, int fd) {
+	char byte = 0;
+	struct iovec iov = { &byte, 1 };
+	union {			// aligned for the control message
+		struct cmsghdr h;
+		char buf[CMSG_SPACE(sizeof(int))];
+	} u;
+	struct msghdr msg;
+	struct cmsghdr *cmsg;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = u.buf;
+	msg.msg_controllen = sizeof(u.buf);
+	cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+	memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+	return sendmsg(link, &msg, MSG_DONTWAIT | MSG_NOSIGNAL) == 1 ? 0 : -1;
+}
+
+/* a backend takes the next player, returns his descriptor, or -1 */
+/* with errno EAGAIN if none is waiting and EPIPE if the router */
+/* is gone */
+static inline int router_recv_fd(int link) {
+	char byte;
+	struct iovec iov = { &byte, 1 };
+	union {
+		struct cmsghdr h;
+		char buf[CMSG_SPACE(sizeof(int))];
+	} u;
+	struct msghdr msg;
+	struct cmsghdr *cmsg;
+	ssize_t n;
+	int fd;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = u.buf;
+	msg.msg_controllen = sizeof(u.buf);
+	while ((n = recvmsg(link, &msg, 0)) == -1 && errno == EINTR);
+	if (n == 0) {
+		errno = EPIPE;
+		return -1;
+	}
+	if (n == -1) {
+		return -1;
+	}
+	cmsg = CMSG_FIRSTHDR(&msg);
+	if (!cmsg || cmsg->cmsg_type != SCM_RIGHTS) {
+		errno = EAGAIN;		// no descriptor came with it
+		return -1;
+	}
+	memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+	return fd;
+}
+
+/* a lost report is fine, the next one comes soon */
+static inline void router_report(int link, const load_t *load) {
+	send(link, load, sizeof(load_t), MSG_DONTWAIT | MSG_NOSIGNAL);
+}
+
+#endif
@@ -0,0 +1,129 @@
+/* live statistics, shared by both servers */
+/* counters are bumped with atomics where things happen and read, */
+/* without stopping anybody, by the stats server, which answers */
+/* every connection to its socket with one "key value" per line */
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdio.h>	// standard input/output
+#include <string.h>	// string operations
+#include <time.h>	// for clock_gettime
+
+#define HISTO 40		// buckets, values up to 2^39
+#define STATS_SUFFIX ".stats"	// stats socket is the server's name + this
+
+/* log2 histogram, bucket b counts values in [2^(b-1), 2^b) */
+/* and bucket 0 counts the zeros */
+typedef struct histo_t {
+	long n;			// samples
+	long total;		// their sum
+	long max;		// the biggest one
+	long bucket[HISTO];	// samples of each bucket
+} histo_t;
+
+typedef struct stats_t {	// everything the stats socket shows
+	long games;		// games with players now
+	long players;		// players in games now
+	long admitted;		// players admitted
+	long rejected;		// players rejected
+	long routed;		// players handed over by a router (-u)
+	long chats;		// chat messages relayed
+	long bytes;		// chat bytes sent to players
+	histo_t admission;	// accept to OK (us)
+	histo_t lock_wait;	// waits for a shard's lock (ns)
+} stats_t;
+
+/* the counters that get a per second rate */
+#define STATS_RATES 4
+static const char *stats_rate_name[STATS_RATES] = { "admitted", "rejected", "chats", "bytes" };
+
+static inline long stats_ns(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+static inline void stats_add(long *counter, long v) {
+	__atomic_add_fetch(counter, v, __ATOMIC_RELAXED);
+}
+
+static inline void histo_add(histo_t *h, long v) {
+	long max = __atomic_load_n(&h->max, __ATOMIC_RELAXED);
+	int b = v > 0 ? 64 - __builtin_clzl(v) : 0;
+
+	if (b >= HISTO) b = HISTO - 1;
+	__atomic_add_fetch(&h->n, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&h->total, v, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&h->bucket[b], 1, __ATOMIC_RELAXED);
+	while (v > max && !__atomic_compare_exchange_n(&h->max, &max, v,
+			1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+/* upper bound of the bucket that holds the pct percentile */
+static inline long histo_pct(const histo_t *h, int pct) {
+	long seen = 0;
+	int b;
+
+	for (b = 0; b < HISTO - 1; b++) {
+		if ((seen += h->bucket[b]) * 100 >= h->n * pct) {
+			break;
+		}
+	}
+	return 1L << b;
+}
+
+/* name_n, name_avg, name_p50/p90/p99 (bucket bounds), name_max, */
+/* then name_lt_<bound> for every bucket that is not empty */
+static inline void histo_print(int fd, const char *name, const histo_t *h) {
+	int b;
+
+	dprintf(fd, "%s_n %ld\n", name, h->n);
+	if (!h->n) {
+		return;
+	}
+	dprintf(fd, "%s_avg %ld\n", name, h->total / h->n);
+	dprintf(fd, "%s_p50 %ld\n", name, histo_pct(h, 50));
+	dprintf(fd, "%s_p90 %ld\n", name, histo_pct(h, 90));
+	dprintf(fd, "%s_p99 %ld\n", name, histo_pct(h, 99));
+	dprintf(fd, "%s_max %ld\n", name, h->max);
+	for (b = 0; b < HISTO; b++) {
+		if (h->bucket[b]) {
+			dprintf(fd, "%s_lt_%ld %ld\n", name, 1L << b, h->bucket[b]);
+		}
+	}
+}
+
+/* called about once a second by the stats server, the rates */
+/* shown are those of the last tick */
+static inline void stats_tick(const stats_t *s, long *last, long *last_ns, double *rate) {
+	long now = stats_ns();
+	long cur[STATS_RATES] = { s->admitted, s->rejected, s->chats, s->bytes };
+	int i;
+
+	if (*last_ns) {
+		for (i = 0; i < STATS_RATES; i++) {
+			rate[i] = (cur[i] - last[i]) * 1e9 / (now - *last_ns);
+		}
+	}
+	memcpy(last, cur, sizeof(cur));
+	*last_ns = now;
+}
+
+static inline void stats_print(int fd, const stats_t *s, const double *rate, long started_ns) {
+	long cur[STATS_RATES] = { s->admitted, s->rejected, s->chats, s->bytes };
+	int i;
+
+	dprintf(fd, "uptime_s %.1f\n", (stats_ns() - started_ns) / 1e9);
+	dprintf(fd, "games %ld\n", s->games);
+	dprintf(fd, "players %ld\n", s->players);
+	dprintf(fd, "routed %ld\n", s->routed);
+	for (i = 0; i < STATS_RATES; i++) {
+		dprintf(fd, "%s %ld\n", stats_rate_name[i], cur[i]);
+		dprintf(fd, "%s_per_s %.1f\n", stats_rate_name[i], rate[i]);
+	}
+	histo_print(fd, "admission_us", &s->admission);
+	histo_print(fd, "lock_wait_ns", &s->lock_wait);
+}
+
+#endif
@@ -0,0 +1,92 @@
+/* zero-copy chat fanout (-z), shared by both servers */
+/* a message is written once into a pipe (the stage), then for */
+/* every recipient tee() duplicates the pipe's pages into a second */
+/* pipe and splice() moves them into its socket, so the message is */
+/* copied from user space once instead of once per recipient */
+/* splice() blocks on a blocking socket whatever its flags say, */
+/* so the recipients' sockets must be non-blocking */
+#ifndef ZCOPY_H
+#define ZCOPY_H
+
+#include <fcntl.h>	// for splice and tee
+#include <unistd.h>	// miscellaneous functions
+#include <errno.h>	// for the errno variable
+
+typedef struct zcopy_t {	// one thread's (or worker's) pipes
+	int stage[2];		// the message, once
+	int scratch[2];		// its pages, for one recipient
+} zcopy_t;
+
+/* returns -1 with errno set if the pipes can not be made */
+static inline int zcopy_open(zcopy_t *z) {
+	if (pipe2(z->stage, O_NONBLOCK | O_CLOEXEC) == -1) {
+		return -1;
+	}
+	if (pipe2(z->scratch, O_NONBLOCK | O_CLOEXEC) == -1) {
+		close(z->stage[0]);
+		close(z->stage[1]);
+		return -1;
+	}
+	return 0;
+}
+
+static inline void zcopy_close(zcopy_t *z) {
+	close(z->stage[0]);
+	close(z->stage[1]);
+	close(z->scratch[0]);
+	close(z->scratch[1]);
+}
+
+/* reads whatever is left in a pipe */
+static inline void zcopy_empty(int fd) {
+	char junk[4096];
+
+	while (read(fd, junk, sizeof(junk)) > 0);
+}
+
+/* stages a message, returns -1 if the pipe did not take all of it */
+static inline int zcopy_stage(zcopy_t *z, const char *frame, size_t len) {
+	if (write(z->stage[1], frame, len) == (ssize_t) len) {
+		return 0;
+	}
+	zcopy_empty(z->stage[0]);
+	return -1;
+}
+
+/* done with the staged message */
+static inline void zcopy_unstage(zcopy_t *z) {
+	zcopy_empty(z->stage[0]);
+}
+
+/* sends the staged message of len bytes to fd, returns the bytes */
+/* the socket took, or -1 if the pages could not be duplicated and */
+/* the message must be copied after all, what the socket did not */
+/* take is thrown away, the caller sends it some other way */
+static inline ssize_t zcopy_send(zcopy_t *z, int fd, size_t len) {
+	size_t done = 0;
+	ssize_t n;
+
+	if (tee(z->stage[0], z->scratch[1], len, SPLICE_F_NONBLOCK) != (ssize_t) len) {
+		zcopy_empty(z->scratch[0]);
+		return -1;
+	}
+	while (done < len) {
+		n = splice(z->scratch[0], NULL, fd, NULL, len - done,
+				SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+		if (n > 0) {
+			done += n;
+		}
+		else if (n == -1 && errno == EINTR) {
+			continue;
+		}
+		else {
+			break;		// full, or gone
+		}
+	}
+	if (done < len) {
+		zcopy_empty(z->scratch[0]);
+	}
+	return done;
+}
+
+#endif
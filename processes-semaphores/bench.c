@@ -0,0 +1,254 @@
+/* microbenchmarks of the server's hot paths: parsing and admission */
+/* of a request, game lookups, resource lookups and the chat relay, */
+/* copied or spliced (-z) */
+/* the server is compiled in and this process plays every player's */
+/* process, players are socketpairs, so no fork and no signals */
+#define main gameserver_main	// ours runs the benchmarks
+#include "server.c"
+#undef main
+#include <sys/mman.h>		// for the big arena of get_game
+#include "../common/bench.h"	// clock and report line
+
+#define OPS 200000	// operations per benchmark
+#define ADMITS 50000	// players admitted, each game is ~70KB of arena
+#define PLAYERS 8	// players per game
+#define BIGCAT 1000	// resources of the big catalog
+#define DRAIN 64	// operations between draining the sockets
+#define SENDS (2 * OPS)	// sends per relay benchmark, whatever the recipients
+
+volatile long sink;	// results, so nothing is optimized away
+char request[] = "bench\ngold 2\narmor 3\nammo 4\nlumber 1\nmagic 2\nrock 3\n";
+
+void bench_parse(void);		// catalog_parse
+void bench_catalog(void);	// catalog_id, small and big catalog
+void bench_lookup(void);	// get_game, 10 to 100k games
+void bench_admit(void);		// catalog_parse and admit_player
+void bench_relay(void);		// relay, copied or spliced, 16 to 4096 recipients
+void drain_socket(int);		// reads what is waiting
+
+// make bench
+
+int main(int argc, char *argv[]) {
+	int i;
+
+	maxplayers = PLAYERS;
+	quota = 100;
+	maxgames = ADMITS / PLAYERS + 1;	// admissions
+	if (chdir("testing") == -1) {	// inventory files are there
+		perror("chdir()\nerrno"); exit(1);	// debugging
+	}
+	strcpy(inv_file, "inventory");
+	signal(SIGPIPE, SIG_IGN);
+	mainpid = getpid();
+	init_arena();
+
+	/* the games never run out of resources */
+	for (i=0; i<catalog.n; i++) {
+		inv_template[i] = 1 << 30;
+	}
+	copy_inventory(get_game(1));
+
+	bench_header();
+	bench_parse();
+	bench_catalog();
+	bench_relay();
+	bench_lookup();
+	bench_admit();
+	return 0;
+}
+
+void bench_parse() {
+	char name[MAX];		// player's name
+	request_t req;		// player's resources
+	long t;
+	int i, sum;
+
+	t = bench_ns();
+	for (i=0; i<OPS; i++) {
+		sum = 0;
+		sink += catalog_parse(&catalog, quota, request, sizeof(request) - 1, name, MAX, &req, &sum);
+	}
+	bench_report("catalog_parse", OPS, bench_ns() - t);
+}
+
+void bench_catalog() {
+	catalog_t big;		// BIGCAT resources
+	char word[MAX];
+	char (*names)[MAX];	// names looked up
+	long t;
+	int i;
+
+	t = bench_ns();
+	for (i=0; i<OPS; i++) {
+		sink += catalog_id(&catalog, catalog.name[i % catalog.n]);
+	}
+	bench_report("catalog_id/6", OPS, bench_ns() - t);
+
+	if (catalog_load(&big, NULL) == -1 || !(names = malloc(BIGCAT * MAX))) {
+		perror("malloc()\nerrno"); exit(1);	// debugging
+	}
+	for (i=big.n; i<BIGCAT; i++) {
+		snprintf(word, MAX, "res%d", i);
+		catalog_add(&big, word);
+	}
+	for (i=0; i<BIGCAT; i++) {	// random order, every one is found
+		strcpy(names[i], big.name[lrand48() % big.n]);
+	}
+	t = bench_ns();
+	for (i=0; i<OPS; i++) {
+		sink += catalog_id(&big, names[i % BIGCAT]);
+	}
+	bench_report("catalog_id/1000", OPS, bench_ns() - t);
+	free(names);
+	catalog_free(&big);
+}
+
+/* 100k games do not fit in a segment, so the lookups use a */
+/* private arena of the same layout, only the touched pages of it */
+/* take memory, random games miss the cache like a busy server */
+void bench_lookup() {
+	static int sizes[] = { 10, 1000, 100000 };
+	char *arena = games;	// the real one
+	char label[32];
+	int *idx;		// games looked up
+	long t;
+	int i, s;
+
+	if ((games = mmap(NULL, sizes[2] * game_size, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0)) == MAP_FAILED) {
+		perror("mmap()\nerrno"); exit(1);	// debugging
+	}
+	for (i=1; i<=sizes[2]; i++) {
+		get_game(i)->active = 0;	// the page is ours
+	}
+	if (!(idx = malloc(OPS * sizeof(int)))) {
+		perror("malloc()\nerrno"); exit(1);	// debugging
+	}
+	for (s=0; s<3; s++) {
+		for (i=0; i<OPS; i++) {
+			idx[i] = 1 + lrand48() % sizes[s];
+		}
+		t = bench_ns();
+		for (i=0; i<OPS; i++) {
+			sink += get_game(idx[i])->active;
+		}
+		snprintf(label, sizeof(label), "get_game/%d", sizes[s]);
+		bench_report(label, OPS, bench_ns() - t);
+	}
+	free(idx);
+	munmap(games, sizes[2] * game_size);
+	games = arena;
+}
+
+/* what a joining player costs once his request has arrived, */
+/* the OK message (one send) included */
+void bench_admit() {
+	char name[MAX];		// player's name
+	request_t req;		// player's resources
+	int sv[2];		// the players' end, our end
+	long t;
+	int i, ok, sum;
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == -1) {
+		perror("socketpair()\nerrno"); exit(1);	// debugging
+	}
+	t = bench_ns();
+	for (i=0; i<ADMITS; i++) {
+		sum = 0;
+		ok = catalog_parse(&catalog, quota, request, sizeof(request) - 1, name, MAX, &req, &sum);
+		if (!admit_player(sv[0], name, &req, sum, ok)) {
+			printf("Benchmark player rejected\n"); exit(1);
+		}
+		if (i % DRAIN == 0) {
+			drain_socket(sv[1]);
+		}
+	}
+	bench_report("admit_player", ADMITS, bench_ns() - t);
+	close(sv[0]);
+	close(sv[1]);
+}
+
+/* one player of a game speaks, the others get it straight from */
+/* his process, as a worker (-w) that serves them all does, copied */
+/* and then spliced (-z), for 16 to 4096 recipients and a full */
+/* chat message, the games are too big for the arena, so each one */
+/* is a private game of the same layout with a slots block */
+void bench_relay() {
+	static int sizes[] = { 16, 256, 4096 };
+	char frame[PROTO_HDR + MAXCHAT];	// framed message
+	char text[MAXCHAT];	// as long as a chat message gets
+	char label[32];
+	char *arena = games, *blocks = slots;	// the real ones
+	struct rlimit rl;	// two descriptors per recipient
+	int (*sv)[2];		// players' ends, our ends
+	size_t len;		// frame's length
+	game_t g;
+	long t;
+	int i, j, s, n, ops;
+
+	if (getrlimit(RLIMIT_NOFILE, &rl) == 0) {
+		rl.rlim_cur = rl.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &rl);
+	}
+	if (!(sv = malloc((sizes[2] + 1) * sizeof(*sv)))) {
+		perror("malloc()\nerrno"); exit(1);	// debugging
+	}
+	memset(text, 'x', MAXCHAT - 1);
+	text[MAXCHAT - 1] = '\0';
+	len = proto_printf(frame, MAXCHAT, MSG_CHAT, "%s", text);
+	workers = 1;		// nobody waits for a slow player
+
+	for (s=0; s<3; s++) {
+		n = sizes[s];
+		ops = SENDS / n;
+		maxplayers = n + 1;	// the speaker and his recipients
+		if (!(games = aligned_alloc(CACHELINE, game_size)) ||
+				!(slots = aligned_alloc(CACHELINE, slots_size()))) {
+			perror("aligned_alloc()\nerrno"); exit(1);	// debugging
+		}
+		memset(games, 0, game_size);
+		memset(slots, 0, slots_size());
+		place_slots(1);
+		g = get_game(1);
+		for (i=0; i<maxplayers; i++) {
+			if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, sv[i]) == -1) {
+				perror("socketpair()\nerrno"); exit(1);	// debugging
+			}
+			g->roster.fd[i] = sv[i][0];
+			g->owner[i] = getpid();
+		}
+		g->active = maxplayers;
+
+		for (zero_copy=0; zero_copy<2; zero_copy++) {
+			t = bench_ns();
+			for (i=0; i<ops; i++) {
+				relay(g, 1, 0, frame, len);
+				if (i % DRAIN == 0) {
+					for (j=1; j<maxplayers; j++) {
+						drain_socket(sv[j][1]);
+					}
+				}
+			}
+			snprintf(label, sizeof(label), "%s/%d", zero_copy ? "relay_z" : "relay", n);
+			bench_report(label, ops, bench_ns() - t);
+		}
+		zero_copy = 0;
+		for (i=0; i<maxplayers; i++) {
+			close(sv[i][0]);
+			close(sv[i][1]);
+		}
+		free(games);
+		free(slots);
+	}
+	workers = 0;
+	maxplayers = PLAYERS;
+	games = arena;
+	slots = blocks;
+	free(sv);
+}
+
+void drain_socket(int fd) {
+	char buf[65536];
+
+	while (recv(fd, buf, sizeof(buf), MSG_DONTWAIT) > 0);
+}
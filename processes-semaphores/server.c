@@ -1,3 +1,4 @@
+#define _GNU_SOURCE	// for accept4
 #include <stdio.h>	// standard input/output
 #include <stdlib.h>	// general purpose functions
 #include <string.h>	// string operations
@@ -11,74 +12,300 @@
 #include <semaphore.h>	// semaphores
 #include <fcntl.h>	// file control options
 #include <errno.h>	// for the errno variable
+#include <sys/epoll.h>	// for the worker event loop
+#include <sys/resource.h>	// for the open files limit
+#include <time.h>	// for clock_gettime
+#include <sys/prctl.h>	// for PR_SET_PDEATHSIG
+#include <sys/signalfd.h>	// chat doorbells as file descriptors
+#include <sys/inotify.h>	// watches the inventory file
+#include <poll.h>	// for the poll function
+#include <limits.h>	// for INT_MAX
+#include <sys/syscall.h>	// for the futex system call
+#include <linux/futex.h>	// futex operations
+#include <ctype.h>	// for toupper
+#include "../common/proto.h"	// framed messages
+#include "../common/catalog.h"	// resources of the game
+#include "../common/stats.h"	// counters of the stats socket
+#include "../common/prof.h"	// lock profiling
+#include "../common/net.h"	// TCP players
+#include "../common/router.h"	// backend of a router (-u)
+#include "../common/game.h"	// layout of a game's players
+#include "../common/zcopy.h"	// spliced chat (-z)
+#include "../common/history.h"	// chat history (-m, -l)
 
 #define PATH "server"		// server hostname
+#define STATS PATH STATS_SUFFIX	// stats socket
 #define MAX 16			// max size for small buffers
-#define MAXBUF 128		// max size for large buffers
+#define SENT_WORDS(n) (((n) + 63) / 64)	// words of a ring entry's sent slots
 #define MAXLISTEN 50		// max queue length for listen
-#define SEMNAME1 "sem_name"	// named semaphore for struct shm
-#define SEMNAME2 "sem_name2"	// named semaphore for chat
+#define MAXSHARDS 64		// max lobby shards
+#define RING HISTORY		// chat messages kept per game
+#define SIGRING SIGRTMIN	// chat doorbell
+#define PEERHASH 1024		// buckets of the peers table
+#define MAXWORKERS 64		// max pre-forked workers
+#define MAXEVENTS 256		// max events per epoll_wait
+#define REMIND 5000		// ms between "Please wait..." messages
+#define MAXGAMES 1024		// default size of the games arena
 
 int shm_id;	// shared memory id
-key_t shm_key;	// shared memory key
 pid_t mainpid;	// main process id (parent)
 FILE *fp;		// file object
 int server;		// server file descriptor
+int tcp_server = -1;	// TCP listening socket (-t), -1 = none
+char *tcp_addr;		// its [host:]port
+char *router_path;	// router's socket (-u), NULL = none
+int router = -1;	// link to the router, -1 = none
+char stats_path[108] = STATS;	// stats socket's name
 
-sem_t *sem_id;		// semaphore for struct shm
-sem_t *sem_id2;		// semaphore for chatting
+int nshards = 1;	// lobby shards in use
 int maxplayers;		// max players per game
+int maxgames = MAXGAMES;	// games the arena holds
 char inv_file[MAX];	// server inventory file
+catalog_t catalog;	// every resource, by id
+char *cat_file;		// catalog file, NULL = the six default resources
+int *inv_template;	// parsed inventory file, in the arena
+char *games;		// first game of the arena
+char *slots;		// the slots of big games, past the games
+size_t game_size;	// bytes of each game, inventory included
 int quota;		// max resources per player
-
-/* games are implemented using linked lists */
-/* "n" node of the list contains data for the "n" game */
+long accepted_at;	// when the player was accepted (us)
+double stats_rate[STATS_RATES];	// rates of the last second, stats process
+int zero_copy;		// splice chat from a pipe instead of copying it (-z)
+zcopy_t zc;		// this process' pipes
+int zc_state;		// 0 = not open yet, 1 = open, -1 = failed
+int history;		// messages replayed to a player who comes back (-m)
+int came_back;		// the player just admitted came back
+char *history_path;	// chat log (-l), NULL = none
+hlog_t hlog;		// the chat log, the flusher's
+pid_t flusher;		// the flusher's process, 0 = none
+volatile sig_atomic_t stop_flushing;	// the server is closing
+int profiling;		// profile the semaphores
+int prof_slot;		// our profile, 0 = shared by the players' processes
+long prof_since[PROF_SITES];	// when we took each site's semaphore
+
+/* call sites of the semaphores, the chat ring has none */
+enum { P_ADMIT, P_LEAVE, P_INVENTORY, P_HISTORY, P_SITES };
+const char *prof_site[P_SITES] = { "admit", "leave", "inventory", "history" };
+
+/* every game lives in one shared memory arena */
+/* slot "n-1" of the arena holds the "n" game, every slot is */
+/* game_size bytes since the inventory is as long as the catalog */
+/* where its slots are (see game.h) comes first, the slots of a */
+/* small game are inline after the ring, those of a bigger one */
+/* are in a block of their own, past every game of the arena */
 typedef struct game_t {		// everything for each game
-	int inv[6];		// resources (inventory)
-	int players[MAX];	// players' file descriptors
-	char names[MAX][MAX];	// players' names
+	roster_t roster;	// players' file descriptors and names
+	pid_t *owner;		// process serving each player
+	unsigned long *cursor;	// next position each player reads
+	int *bell;		// doorbell pending for each player
+	int *gen;		// bumped every time a slot is taken
+	pid_t *writer;		// process writing a frame to each player (-w)
+	unsigned long *sent;	// slots the sender of each ring entry served
 	int active;		// active players in game
-	struct game_t *next;	// next game
-
-	int temp_shm;		// used to clear shared memory segments
+	int started;		// it filled up, its players may go on
+	int joins;		// bumped by every insert, waiting players sleep on it
+	int shard;		// shard that fills the game
+	int round;		// odd while the game is reset for reuse, even when ready
+	int next_free;		// next finished game, 0 = none
+
+	/* chatting: lock-free ring, any player's process may write */
+	/* and every process reads it for its own players */
+	struct chat_t {
+		unsigned long seq;	// 2*pos+1 while written, 2*pos+2 when done
+		int from;		// sender's slot
+		int len;		// frame's length
+		char frame[PROTO_HDR + MAXCHAT];	// framed message
+	} chat[RING];
+	unsigned long head;		// next position to write
+	unsigned long hist_start;	// first position of this round (-m)
+	unsigned long logged;		// next position for the log, the flusher's (-l)
+	struct {	// the slots of a game of up to MAXPLAYERS players
+		slots_t roster;			// descriptors and names
+		pid_t owner[MAXPLAYERS];	// serving processes
+		unsigned long cursor[MAXPLAYERS];	// read positions
+		int bell[MAXPLAYERS];		// pending doorbells
+		int gen[MAXPLAYERS];		// slot generations
+		pid_t writer[MAXPLAYERS];	// processes writing to them
+		unsigned long sent[RING];	// a word of sent slots per entry
+	} small;
+	int inv[];			// resources (inventory), catalog.n
 } *game_t;
 
-struct shm_t {			// shared memory segment
-	game_t game;		// first game
-	int game_num;		// number of games
+/* players' descriptors are passed between processes (SCM_RIGHTS) */
+/* so the sender's process writes to every other player directly */
+typedef struct peers_t {	// our copies of a game's descriptors
+	int game_number;	// the game
+	game_t g;		// attached game
+	int local;		// our own players in the game
+	int *fd;		// copy of each slot's descriptor, 0 = none
+	int *gen;		// slot generation of each copy
+	struct peers_t *next;	// next in hash bucket
+} peers_t;
+
+struct handoff_t {		// sent along with a descriptor
+	int game_number;	// player's game
+	int slot;		// player's slot
+	int gen;		// slot generation
+	int reply;		// 0 = new player, 1 = answer to a new player
+};
 
-	/* chatting */
-	char message[MAXBUF];	// message to send
-	int client;		// message source
-	int gamenum;		// which game to send the message
+struct shm_t {			// shared memory segment
+	int game_num;		// number of games (highest game number)
+	unsigned long free_games;	// finished games: a number, a tag above it
+
+	/* players join through one of several lobby shards, every */
+	/* shard fills its own game, so games fill in parallel */
+	struct shard_t {
+		sem_t lock;		// inserts into the shard's games
+		int game_number;	// game being filled
+	} shard[MAXSHARDS];
+	int next_shard;		// round robin among the shards
+	seat_t seats[SEATS];	// where players who left sat (-m)
+	sem_t seat_lock;	// leaving and returning players
+	int log_bell;		// 1 = a game is half a ring ahead of the log (-l)
+
+	/* the inventory file is parsed once, new games copy it */
+	/* and the monitor process replaces it when the file changes */
+	sem_t inv_lock;		// the monitor and new games
+
+	/* counters of the stats socket, every process adds to them */
+	stats_t stats;
+	long started_ns;	// when the server started
+
+	/* lock profiling (-P): every worker writes its own profile, */
+	/* the processes of the players share the first one */
+	prof_t prof[MAXWORKERS + 1];
+
+	char arena[] __attribute__((aligned(CACHELINE)));	// inventory file, then maxgames games
 } *shm;
 
+/* worker pool mode (-w): a fixed number of pre-forked workers */
+/* share the listening socket, each one serves many players */
+enum { CL_JOIN, CL_WAIT, CL_PLAY };	// connection states
+typedef struct conn_t {	// everything for each connection
+	int state;		// CL_JOIN, CL_WAIT or CL_PLAY
+	int game_number;	// player's game
+	game_t g;		// player's game, attached once
+	int slot;		// player's slot in the game
+	char name[MAX];		// player's name
+	long accepted;		// when it was accepted (us)
+	long deadline;		// next "Please wait..." (ms)
+	int prev, next;		// waiting room list (fds, -1 = none)
+	frames_t in;		// player's messages, maybe partial
+} conn_t;
+
+/* a worker never waits for one player, what a socket does not */
+/* take of a frame waits here till the socket is writable */
+typedef struct pend_t {		// rest of a frame, by descriptor (-w)
+	char *rest;		// the frame's bytes, NULL = none
+	size_t off, len;	// bytes written, and all of them
+	game_t g;		// the player's game
+	int game_number;	// its number
+	int slot, gen;		// the player's slot and its generation
+	int copy;		// a peer's descriptor, in epoll for this only
+} pend_t;
+
+int workers;			// number of workers, 0 = fork per player
+pid_t worker_pid[MAXWORKERS];	// workers' process ids
+int epfd;		// worker's epoll file descriptor
+int sfd;		// chat doorbells (signalfd)
+int hfd;		// descriptor handoffs (SOCK_DGRAM)
+peers_t *peer_table[PEERHASH];	// games we serve players in
+conn_t *conns;		// worker's connections, indexed by fd
+int max_conns;		// size of conns
+pend_t *pend;		// worker's rests of frames, indexed by fd
+int max_pend;		// size of pend
+int wait_head = -1;	// first waiting player
+int wait_tail = -1;	// last waiting player
+
 void terminate(int);		// signal handler for ctrl-c
 void destroy_everything(void);	// clear memory, close server
-void show_info(int);		// pretty info, handler for ctrl-z
+void show_info(int);		// stats and games, for the stats socket
+void serve_stats(void);		// forks the stats process
+void report_load(void);		// tells the router our load
+long inventory_left(void);	// resources left in the games being filled
 void sig_chld(int);		// no zombie processes
-void send_msg(int);		// signal for chatting
 void init_server(void);		// start server
+void init_arena(void);		// catalog, arena and first games
 game_t get_game(int);		// get current game
-void read_inventory(char *);	// read server's inventory file
-int resource_id(char *);	// hashing function for resources
+size_t slots_size(void);		// bytes of a big game's slots
+void place_slots(int);		// points a game to its slots
+int read_inventory(char *, int *);	// read server's inventory file
+void copy_inventory(game_t);	// new game gets the inventory
+void watch_inventory(void);	// forks the inventory monitor
 void action(int);		// does everything for the player
-int insert_player(int, char *);	// connect a player with the server
+int insert_player(int, char *, frames_t *);	// connect a player with the server
+int admit_player(int, char *, request_t *, int, int);	// add player to a game
+int rejoin_player(int, char *);	// a player takes the old seat back (-m)
+void replay_history(game_t, int, int, int);	// the last messages, to a player who came back
+void flush_history(void);	// forks the flusher of the chat log (-l)
+void stop_flusher(int);		// its signal handler
+int claim_game(void);		// a finished game, or the next of the arena
+int next_game(struct shard_t *);	// the shard moves on to a new game
+void free_game(int);		// the game waits to be reused
+int *game_link(int);		// its next_free, for the free list
+int leave_game(int, int);	// player leaves, 1 if the game is over
+void lock_shard(struct shard_t *);	// locks a shard, the wait is counted
+void lock_at(sem_t *, int);	// sem_lock, profiled at a call site
+void unlock_at(sem_t *, int);	// sem_post, profiled at a call site
+void record_admission(long);	// accept-to-OK latency
 void remove_player(int, int);	// kills player
+void relay(game_t, int, int, char *, int);	// send a chat message
+int stage_chat(char *, int);	// stages a message for splicing (-z)
+void ring(game_t, int, int);	// wakes the process serving a player
+void futex_wait(int *, int, long);	// sleep while *addr == val
+void futex_wake(int *);		// wake everybody sleeping on addr
+void drain(game_t, int, int);	// send new messages to a player
+int take_writer(game_t, int);	// only we write to the player
+int ask_writer(game_t, int);	// or his writer rings when done
+void give_writer(game_t, int, int, int);	// others may write to him again
+int write_frame(game_t, int, int, int, const char *, size_t, int);	// what the socket takes
+void keep_rest(int, game_t, int, int, int, const char *, size_t);	// the rest waits
+void flush_rest(int);		// the socket is writable again
+void drop_rest(int);		// the descriptor is closed, the rest too
+void nudge(game_t, int, int, int);	// the player's process catches up
+void close_copy(int);		// closes our copy of a descriptor
+void doorbell_fd(void);		// blocks SIGRING, opens sfd
+void handoff_fd(void);		// opens hfd
+void handoff_addr(pid_t, struct sockaddr_un *, socklen_t *);	// hfd's name
+void send_fd(pid_t, int, int, int, int, int);	// pass a descriptor
+void announce(peers_t *, int);	// pass a new player to his game
+void handoffs(void);		// receives passed descriptors
+peers_t *find_peers(int);	// our copies for a game
+peers_t *join_peers(int);	// one more player of ours
+void leave_peers(int);		// one less player of ours
+int peer_fd(peers_t *, int);	// our copy of a slot's descriptor
+int player_slot(game_t, int);	// player's slot in the game
+void sem_lock(sem_t *);		// sem_wait, even if interrupted
+
+void supervise(void);		// parent keeps the workers alive
+pid_t spawn_worker(int);	// forks worker i
+void release_players(pid_t);	// frees a dead worker's slots
+void worker_loop(void);		// worker serves many players
+void accept_players(int);	// accepts every pending connection
+void route_players(void);	// takes players handed over by the router
+void open_conn(int);		// a new player's connection
+void player_event(int);		// handles input of a connection
+void doorbells(void);		// drains games that rang us
+void start_player(int);		// sends START to a waiting player
+void remind_players(void);	// sends "Please wait..." when it is due
+void drop_player(int);		// closes a connection
+void wait_push(int);		// add player to the waiting room
+void wait_pop(int);		// remove player from the waiting room
+long now_us(void);		// monotonic clock in microseconds
 
 // ./gameserver -p 3 -i inventory -q 5
 
 int main(int argc, char *argv[]) {
 	int new_fd;			// player's file descriptor
 	pid_t pid;			// process id, fork return value
-	socklen_t addr_size;		// size of address
-	struct sockaddr_un cl_addr;	// Unix domain sockets
+	struct pollfd lfd[3];		// Unix and TCP listening sockets, router
+	int i;
 
 	/* checks if all arguments are OK */
-	/* maxplayers must be < MAX, for static memory management */
-	if (argc != 7 || atoi(argv[2]) > MAX) {
+	if (argc < 7) {
 		printf("Run the server by writing:\n");
-		printf("./gameserver –p <num_of_players> -i <game_inventory> -q <quota_per_player>\n");
+		printf("./gameserver –p <num_of_players> -i <game_inventory> -q <quota_per_player> [-w <workers>] [-z] [-g <max_games>] [-s <shards>] [-c <catalog>] [-P] [-t <[host:]port>] [-u <router>] [-m <history>] [-l <chat_log>]\n");
 		exit(1);
 	}
 
@@ -103,110 +330,259 @@ int main(int argc, char *argv[]) {
 		printf("Argument 5 must be -q\n"); exit(1);
 	}
 
+	for (i=7; i<argc; i++) {	// optional arguments
+		if (!strcmp(argv[i], "-w") && i+1 < argc) {
+			workers = atoi(argv[++i]);	// pre-forked workers
+			if (workers < 1 || workers > MAXWORKERS) {
+				printf("Workers must be between 1 and %d\n", MAXWORKERS); exit(1);
+			}
+		}
+		else if (!strcmp(argv[i], "-z")) {
+			zero_copy = 1;		// chat is spliced, not copied
+		}
+		else if (!strcmp(argv[i], "-g") && i+1 < argc) {
+			maxgames = atoi(argv[++i]);	// games arena size
+			if (maxgames < 1) {
+				printf("Max games must be at least 1\n"); exit(1);
+			}
+		}
+		else if (!strcmp(argv[i], "-s") && i+1 < argc) {
+			nshards = atoi(argv[++i]);	// games filled in parallel
+			if (nshards < 1 || nshards > MAXSHARDS) {
+				printf("Shards must be between 1 and %d\n", MAXSHARDS); exit(1);
+			}
+		}
+		else if (!strcmp(argv[i], "-c") && i+1 < argc) {
+			cat_file = argv[++i];	// resources of the game
+		}
+		else if (!strcmp(argv[i], "-P")) {
+			profiling = 1;		// semaphore waits and hold times
+		}
+		else if (!strcmp(argv[i], "-t") && i+1 < argc) {
+			tcp_addr = argv[++i];	// players over the network too
+		}
+		else if (!strcmp(argv[i], "-u") && i+1 < argc) {
+			router_path = argv[++i];	// players come from a router
+		}
+		else if (!strcmp(argv[i], "-m") && i+1 < argc) {
+			history = atoi(argv[++i]);	// players may come back
+			if (history < 1 || history > HISTORY) {
+				printf("History must be between 1 and %d\n", HISTORY); exit(1);
+			}
+		}
+		else if (!strcmp(argv[i], "-l") && i+1 < argc) {
+			history_path = argv[++i];	// chat is logged
+		}
+		else {
+			printf("Unknown argument %s\n", argv[i]); exit(1);
+		}
+	}
+	/* splice() blocks on a blocking socket, only the workers */
+	/* make them non-blocking */
+	if (zero_copy && !workers) {
+		printf("-z needs -w\n"); exit(1);
+	}
+
 	init_server();	// start server!
 	
 	printf("\n~~~~~ Server Started! ~~~~~\n");
-	printf("\n~~~ Press Ctrl-Z to view games and inventories! ~~~\n\n");
+	printf("\n~~~ Connect to %s to view games and stats! ~~~\n\n", stats_path);
+	if (router_path) {
+		printf("~~~ Players come from the router at %s ~~~\n\n", router_path);
+	}
+	if (tcp_addr) {
+		printf("~~~ Players may also connect to %s ~~~\n\n", tcp_addr);
+	}
+
+	if (workers) {
+		supervise();	// never returns
+	}
 
-	addr_size = sizeof(struct sockaddr_un);
+	lfd[0].fd = server;		// poll skips the ones that are -1
+	lfd[1].fd = tcp_server;
+	lfd[2].fd = router;
+	lfd[0].events = lfd[1].events = lfd[2].events = POLLIN;
 	while (1) {
-		if ((new_fd = accept(server, (struct sockaddr *) &cl_addr, &addr_size)) == -1) {
-			perror("accept()\nerrno"); exit(1);	// debugging
+		if (poll(lfd, 3, -1) == -1) {
+			continue;	// interrupted by a signal
 		}
+		for (i=0; i<3; i++) {
+			if (!lfd[i].revents) {
+				continue;
+			}
+			if (lfd[i].fd == router) {	// handed over by the router
+				if ((new_fd = router_recv_fd(router)) == -1) {
+					if (errno == EAGAIN) continue;
+					printf("Router closed, no more players\n");
+					lfd[i].fd = -1;
+					continue;
+				}
+				stats_add(&shm->stats.routed, 1);
+			}
+			else if ((new_fd = accept(lfd[i].fd, NULL, NULL)) == -1) {
+				if (errno == EINTR) continue;	// a child ended
+				perror("accept()\nerrno"); exit(1);	// debugging
+			}
+			accepted_at = now_us();		// for the latency stats
+			if (lfd[i].fd == tcp_server) {
+				tcp_nodelay(new_fd);	// chat leaves at once
+			}
 
-		if ((pid = fork()) == -1) {
-			perror("fork()\nerrno"); exit(1);	// debugging
-		}
+			if ((pid = fork()) == -1) {
+				perror("fork()\nerrno"); exit(1);	// debugging
+			}
 
-		if (pid == 0) { 		// child
-			close(server);		// no longer needed
-			action(new_fd);		// does everything
+			if (pid == 0) { 		// child
+				close(server);		// no longer needed
+				if (tcp_server != -1) {
+					close(tcp_server);
+				}
+				if (router != -1) {
+					close(router);
+				}
+				action(new_fd);		// does everything
+			}
+			close(new_fd);		// only the child talks to the player
 		}
-
 	}
 
 	return 0;	// unreachable
 }
 
-void destroy_everything() {	// clear memory and remove files
+void destroy_everything() {	// clear semaphores and server file
 	int i;
-	char buf[MAX];	// buffer
 
-	for (i=0; i<shm->game_num; i++) {
-		shm_id = get_game(i+1)->temp_shm;
-		shmctl (shm_id , IPC_RMID , 0);	// clear shared memory
-
-		snprintf(buf, MAX, "%d", i);
-		remove(buf);			// remove files
+	/* the arena is already set for destruction, it goes */
+	/* away when the last process detaches */
+	for (i=0; i<nshards; i++) {
+		sem_destroy(&shm->shard[i].lock);	// destroy semaphores
 	}
-	snprintf(buf, MAX, "%d", shm->game_num);
-	remove(buf);			// remove last file
-
-	sem_close(sem_id);		// close first semaphore
-	sem_close(sem_id2);		// close second semaphore
-	sem_unlink(SEMNAME1);	// remove named semaphore
-	sem_unlink(SEMNAME2);	// remove named semaphore
-	remove(PATH);			// remove server file
+	sem_destroy(&shm->inv_lock);
+	sem_destroy(&shm->seat_lock);
+	if (!router_path) {
+		remove(PATH);		// remove server file
+	}
+	remove(stats_path);		// and stats file
 }
 
 void terminate(int signo) {		// close server!
 	if (getpid() == mainpid) {	// main process (parent)
 		printf("\n~~~~~ Server Closing! ~~~~~\n\n");
+		/* the log is cut to its last line before the games go */
+		if (flusher) {
+			kill(flusher, SIGINT);
+			while (waitpid(flusher, NULL, 0) == -1 && errno == EINTR);
+		}
 		destroy_everything();	// destroy everything!
 		usleep(100000);		// wait for child processes
 	}
 	_exit(0);	// kill all processes
 }
 
-void send_msg(int signo) {
-	int i, cl;
-	game_t g;			// game to which to send the message
-	signal(SIGUSR1, send_msg);	// set signal handler
-
-	if (getpid() == mainpid) {	// server sends the message
-		g = get_game(shm->gamenum);
-		cl = shm->client;
+/* counters, rates and latencies, then the games being filled */
+/* and what is left of their inventories, nothing is locked so */
+/* the numbers of a busy server may be a little off */
+void show_info(int fd) {
+	prof_t *all[MAXWORKERS + 1];	// every profile
+	game_t g;
+	int i, j, n;
 
-		for (i=0; i<maxplayers; i++) {
-			/* sends the message to all other players of the same game */
-			if (g->players[i] != 0 && g->players[i] != cl) {
-				send(g->players[i], shm->message, MAXBUF, 0); // send!
+	stats_print(fd, &shm->stats, stats_rate, shm->started_ns);
+	if (profiling) {	// summed
+		for (i=0; i<=MAXWORKERS; i++) {
+			all[i] = &shm->prof[i];
+		}
+		prof_print(fd, prof_site, P_SITES, all, MAXWORKERS + 1);
+	}
+	for (i=0; i<nshards; i++) {
+		n = __atomic_load_n(&shm->shard[i].game_number, __ATOMIC_ACQUIRE);
+		g = get_game(n);
+		dprintf(fd, "game %d shard %d players %d\n", n, i, g->active);
+		for (j=0; j<maxplayers; j++) {
+			if (g->roster.fd[j]) {
+				dprintf(fd, "game %d player %.*s\n", n, NAMELEN, g->roster.name[j]);
 			}
 		}
+		for (j=0; j<catalog.n; j++) {	// inventory for each game
+			dprintf(fd, "game %d %s %d\n", n, catalog.name[j], g->inv[j]);
+		}
+	}
+}
+
+/* the stats process reads the counters in shared memory, one */
+/* report per connection, the rates are worked out every second */
+void serve_stats() {
+	struct sockaddr_un addr;	// stats socket
+	struct pollfd p = { 0, POLLIN, 0 };
+	long last[STATS_RATES], last_ns = 0;	// previous tick
+	long last_report = 0;	// previous load report (-u)
+	int fd;
+
+	if ((fd = fork()) == -1) {
+		perror("fork()\nerrno"); exit(1);	// debugging
+	}
+	if (fd > 0) {
+		return;		// parent
+	}
+	prctl(PR_SET_PDEATHSIG, SIGINT);	// die with the server
+
+	memset(&addr, 0, sizeof(struct sockaddr_un));
+	addr.sun_family = AF_UNIX;
+	snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", stats_path);
+	if ((p.fd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1) {
+		perror("socket()\nerrno"); _exit(1);	// debugging
+	}
+	remove(stats_path);	// remove stats file if already exists
+	if (bind(p.fd, (struct sockaddr *) &addr, sizeof(struct sockaddr_un)) == -1 ||
+			listen(p.fd, MAXLISTEN) == -1) {
+		perror("bind()\nerrno"); _exit(1);	// debugging
+	}
+
+	while (1) {
+		if (stats_ns() - last_ns >= 1000000000L) {
+			stats_tick(&shm->stats, last, &last_ns, stats_rate);
+		}
+		if (router != -1 && stats_ns() - last_report >= REPORT * 1000000L) {
+			report_load();
+			last_report = stats_ns();
+		}
+		if (poll(&p, 1, router != -1 ? REPORT : 1000) != 1) {
+			continue;	// time for a tick
+		}
+		if ((fd = accept(p.fd, NULL, NULL)) == -1) {
+			continue;
+		}
+		show_info(fd);
+		close(fd);
 	}
 }
 
-void show_info(int signo) {		// pretty function
+/* the router picks a backend by these, the first report also */
+/* tells it who we are */
+void report_load() {
+	load_t load;
+
+	load.pid = mainpid;
+	load.routed = shm->stats.routed;
+	load.games = shm->stats.games;
+	load.players = shm->stats.players;
+	load.inventory = inventory_left();
+	router_report(router, &load);
+}
+
+/* nothing is locked, the router only needs a rough figure */
+long inventory_left() {
 	game_t g;
+	long left = 0;
 	int i, j;
-	int empty;
-
-	if (getpid() == mainpid) {	// main process shows the info
-		for (i=0; i<shm->game_num; i++) {
-			g = get_game(i+1);		// get game
-			printf("\n~~~~~ GAME %d ~~~~~ \n", i+1);
-			printf("\nOnline players :\n");
-			empty = 1;			// flag for empty game
-			for (j=0; j<maxplayers; j++) {
-				if (g->players[j]) {
-					empty = 0;	// game is not empty
-					printf("%s\n", g->names[j]);
-				}
-			}
-			if (empty) {			// game is empty..
-				printf("No online players..\n");
-			}
-			/* inventory for each game */
-			printf("\nInventory [ %d ] :\n", i+1);
-			printf("Gold : %d\n", g->inv[0]);
-			printf("Armor : %d\n", g->inv[1]);
-			printf("Ammo : %d\n", g->inv[2]);
-			printf("Lumber : %d\n", g->inv[3]);
-			printf("Magic : %d\n", g->inv[4]);
-			printf("Rock : %d\n", g->inv[5]);
+
+	for (i=0; i<nshards; i++) {
+		g = get_game(__atomic_load_n(&shm->shard[i].game_number, __ATOMIC_ACQUIRE));
+		for (j=0; j<catalog.n; j++) {
+			left += __atomic_load_n(&g->inv[j], __ATOMIC_RELAXED);
 		}
-		printf("\n~~~ That's all! ~~~\n\n");
 	}
+	return left;
 }
 
 void sig_chld(int signo) {
@@ -219,52 +595,87 @@ void sig_chld(int signo) {
 
 void init_server() {
 	struct sockaddr_un srv_addr;			// Unix domain sockets
-	sem_id=sem_open(SEMNAME1, O_CREAT, 0600, 1);	// open named semaphore
-	sem_id2=sem_open(SEMNAME2, O_CREAT, 0600, 1);	// open named semaphore
-	int i;
 	mainpid = getpid();		// main process id (parent)
 
 	signal(SIGCHLD, sig_chld);	// set signal handler for zombies
-	signal(SIGUSR1, send_msg);	// set signal handler for chatting
+	signal(SIGPIPE, SIG_IGN);	// players may leave while we send
 
 	if ( signal(SIGINT, terminate) == SIG_ERR ) {
 		perror("signal()\nerrno"); exit(1);	// debugging
 	}
-	if ( signal(SIGTSTP, show_info) == SIG_ERR ) {
-		perror("signal()\nerrno"); exit(1);	// debugging
+
+	init_arena();		// every shard gets its first game
+	shm->started_ns = stats_ns();
+
+	/* a backend (-u) has no socket of its own for the players, */
+	/* it shares the router's directory with the other backends */
+	if (router_path) {
+		if ((router = router_link(router_path)) == -1) {
+			perror("router_link()\nerrno"); exit(1);	// debugging
+		}
+		snprintf(stats_path, sizeof(stats_path), "%s.%d%s", PATH, mainpid, STATS_SUFFIX);
 	}
-	/* unique shm keys are associated with files in current directory */
-	/* file "0" is for the shm struct */
-	/* file "n" is for the "n" game */
-	fp = fopen("0", "a+");		// create file
-	fclose(fp);			// close file
-	shm_key = ftok("0", 'x');	// key for shm file
 
-	/* get shared memory id for the shm struct */
-	if ((shm_id = shmget(shm_key, sizeof(struct shm_t), IPC_CREAT | 0666)) == -1) {
-		perror("shmget()\nerrno"); exit(1);	// debugging
+	watch_inventory();	// reloads the inventory file
+	serve_stats();		// answers the stats socket, reports to the router
+	if (history_path) {
+		flush_history();	// logs the chat
 	}
 
-	/* attach shared memory segment to shm */
-	if ((long) (shm = (struct shm_t *) shmat(shm_id, (void *) 0, 0)) == -1) {
-		perror("shmat()\nerrno"); exit(1);	// debugging
+	if (router_path) {
+		server = -1;	// the router's socket is enough
+	}
+	else {
+		/****** start server ******/
+		memset(&srv_addr, 0, sizeof(struct sockaddr_un));
+		srv_addr.sun_family = AF_UNIX;
+		strncpy(srv_addr.sun_path, PATH,
+				sizeof(srv_addr.sun_path) - 1);	// server hostname
+
+		if ((server = socket(AF_UNIX, SOCK_STREAM, 0)) == -1) {
+			perror("socket()\nerrno"); exit(1);	// debugging
+		}
+
+		remove(PATH);	// remove server file if already exists
+		if (bind(server, (struct sockaddr *) &srv_addr,
+				sizeof(struct sockaddr_un)) == -1) {
+			perror("bind()\nerrno"); exit(1);	// debugging
+		}
+
+		/* the workers expect connection storms */
+		if (listen(server, workers ? SOMAXCONN : MAXLISTEN) == -1) {
+			perror("listen()\nerrno"); exit(1);	// debugging
+		}
 	}
 
-	/* set shared memory segment for destruction */
-	if (shmctl (shm_id , IPC_RMID , 0) == -1) {
-		perror("schctl()\nerrno"); exit(1);	// debugging
+	/* players on other machines (-t), same protocol */
+	if (tcp_addr && (tcp_server = tcp_listen(tcp_addr, workers ? SOMAXCONN : MAXLISTEN)) == -1) {
+		perror("tcp_listen()\nerrno"); exit(1);	// debugging
+	}
+}
+
+/* everything but the sockets and processes, the benchmarks use it too */
+void init_arena() {
+	size_t inv_size;		// bytes of the inventory file
+	int i;
+
+	/* resources are numbered once, by the catalog, children */
+	/* inherit it along with the sizes of the arena */
+	if (catalog_load(&catalog, cat_file) == -1) {
+		printf("Could not load the catalog %s\n", cat_file); exit(1);
 	}
-	fp = fopen("1", "a+");		// shared memory for first game
-	fclose(fp);			// close file
-	shm_key = ftok("1", 'x');	// create unique key
+	inv_size = (catalog.n * sizeof(int) + CACHELINE - 1) & ~(CACHELINE - 1);
+	game_size = GAME_SIZE(struct game_t, catalog.n);
 
-	/* get shared memory id for the first game */
-	if ((shm_id = shmget(shm_key, sizeof(*(shm->game)), IPC_CREAT | 0666)) == -1) {
+	/* one private segment holds the shm struct and every game, */
+	/* children inherit the mapping so no keys or files are needed */
+	if ((shm_id = shmget(IPC_PRIVATE, sizeof(struct shm_t) + inv_size +
+			maxgames * (game_size + slots_size()), IPC_CREAT | 0600)) == -1) {
 		perror("shmget()\nerrno"); exit(1);	// debugging
 	}
 
-	/* attach shared memory segment to shm->game */
-	if ((long)(shm->game = (game_t) (shmat(shm_id, (void *) 0, 0))) == -1) {
+	/* attach shared memory segment to shm */
+	if ((long) (shm = (struct shm_t *) shmat(shm_id, (void *) 0, 0)) == -1) {
 		perror("shmat()\nerrno"); exit(1);	// debugging
 	}
 
@@ -272,279 +683,1635 @@ void init_server() {
 	if (shmctl (shm_id , IPC_RMID , 0) == -1) {
 		perror("schctl()\nerrno"); exit(1);	// debugging
 	}
+	inv_template = (int *) shm->arena;
+	shm->prof[0].shared = 1;	// players' processes
+	games = shm->arena + inv_size;
+	slots = games + maxgames * game_size;
 
-	/* set initial values to game */
-	for (i=0; i<maxplayers; i++) {
-		shm->game->players[i] = 0;	// set file descriptors to 0
+	if (nshards > maxgames) {
+		printf("Every shard needs a game of the arena\n"); exit(1);
+	}
+	/* the file is parsed once, games copy it */
+	if (sem_init(&shm->inv_lock, 1, 1) == -1 ||	// shared by processes
+			sem_init(&shm->seat_lock, 1, 1) == -1) {
+		perror("sem_init()\nerrno"); exit(1);	// debugging
+	}
+	if (read_inventory(inv_file, inv_template) == -1) {
+		exit(1);
 	}
-	shm->game->next = NULL;			// no next game
-	shm->game->active = 0;			// no active players
-	shm->game_num = 1;			// first game
-
-	read_inventory(inv_file);		// read inventory file
-
-	/****** start server ******/
-	memset(&srv_addr, 0, sizeof(struct sockaddr_un));
-	srv_addr.sun_family = AF_UNIX;
-	strncpy(srv_addr.sun_path, PATH,
-			sizeof(srv_addr.sun_path) - 1);	// server hostname
 
-	if ((server = socket(AF_UNIX, SOCK_STREAM, 0)) == -1) {
-		perror("socket()\nerrno"); exit(1);	// debugging
+	for (i=0; i<nshards; i++) {	// every shard fills its first game
+		if (sem_init(&shm->shard[i].lock, 1, 1) == -1) {	// shared by processes
+			perror("sem_init()\nerrno"); exit(1);	// debugging
+		}
+		shm->shard[i].game_number = i+1;
+		place_slots(i+1);
+		get_game(i+1)->shard = i;
+		copy_inventory(get_game(i+1));	// set inventory
 	}
+	shm->game_num = nshards;
+}
 
-	remove(PATH);	// remove server file if already exists
-	if (bind(server, (struct sockaddr *) &srv_addr,
-            sizeof(struct sockaddr_un)) == -1) {
-        perror("bind()\nerrno"); exit(1);		// debugging
+/* bytes of a big game's slots, the arena keeps one block of */
+/* them per game, 0 for small games (see game.h) */
+size_t slots_size() {
+	if (maxplayers <= MAXPLAYERS) {
+		return 0;
 	}
+	return ROSTER_BYTES(maxplayers) + SLOTS_BYTES(maxplayers, sizeof(pid_t)) +
+		SLOTS_BYTES(maxplayers, sizeof(unsigned long)) + 2 * SLOTS_BYTES(maxplayers, sizeof(int)) +
+		SLOTS_BYTES(maxplayers, sizeof(pid_t)) +
+		SLOTS_BYTES(RING * SENT_WORDS(maxplayers), sizeof(unsigned long));
+}
 
-	if (listen(server, MAXLISTEN) == -1) {
-		perror("listen()\nerrno"); exit(1);	// debugging
+/* points game "number" to its slots, before its first round */
+/* every process maps the arena at the same address, so the */
+/* pointers hold in all of them */
+void place_slots(int number) {
+	game_t g = get_game(number);
+	char *block = slots + (number-1) * slots_size();	// a big game's slots
+
+	roster_place(&g->roster, &g->small.roster, &block, maxplayers);
+	if (maxplayers <= MAXPLAYERS) {
+		g->owner = g->small.owner;
+		g->cursor = g->small.cursor;
+		g->bell = g->small.bell;
+		g->gen = g->small.gen;
+		g->writer = g->small.writer;
+		g->sent = g->small.sent;
+		return;
 	}
+	g->owner = (pid_t *) slots_carve(&block, maxplayers, sizeof(pid_t));
+	g->cursor = (unsigned long *) slots_carve(&block, maxplayers, sizeof(unsigned long));
+	g->bell = (int *) slots_carve(&block, maxplayers, sizeof(int));
+	g->gen = (int *) slots_carve(&block, maxplayers, sizeof(int));
+	g->writer = (pid_t *) slots_carve(&block, maxplayers, sizeof(pid_t));
+	g->sent = (unsigned long *) slots_carve(&block, RING * SENT_WORDS(maxplayers), sizeof(unsigned long));
 }
 
-/* returns node "number" of the linked list */
+/* returns game "number", straight from the arena */
 game_t get_game(int number) {
-	game_t current_game;	// current game, return value
-	char buf[MAX];		// buffer
-
-	if (number == 1) return shm->game;	// return first game
+	return (game_t) (games + (number-1) * game_size);
+}
 
-	snprintf(buf, MAX, "%d", number);	// copy number to buffer
-	shm_key = ftok(buf, 'x');		// get unique key
+/* parses an inventory file, returns -1 if it is wrong */
+int read_inventory(char * fname, int *inv) {
+	int i, num;
+	int *parsed;		// missing resources are 0
+	char word[RESNAME];	// holds each line
 
-	/* get shared memory id for the "number" game */
-	if ((shm_id = shmget(shm_key, sizeof(*current_game), IPC_CREAT | 0666)) == -1) {
-		perror("shmget()\nerrno"); exit(1);
+	if ((fp = fopen(fname, "r")) == NULL) {
+		perror("File does not exist\nerrno");	// debugging
+		return -1;
+	}
+	if (!(parsed = (int *) calloc(catalog.n, sizeof(int)))) {
+		perror("calloc()\nerrno"); _exit(1);	// debugging
 	}
 
-	/* attach shared memory segment to current_game */
-	if ((long)(current_game = (game_t) (shmat(shm_id, (void *) 0, 0))) == -1) {
-		perror("shmat()\nerrno"); exit(1);
+	while( fscanf(fp, "%15s\t%d\n", word, &num) == 2 ) {
+		i = catalog_id(&catalog, word);	// hashed lookup
+
+		if (i == -1) {	// item does not exist
+			printf("Wrong inventory, unknown resource %s\n", word);
+			fclose(fp);
+			free(parsed);
+			return -1;
+		}
+		parsed[i] = num;	// set inventory values
 	}
+	fclose(fp);		// close file
 
-	/* if shmctl is executed, the shared memory will get destroyed */
-	/* immediately as the function returns -- temp_shm holds the id */
-	/* so it can be destroyed when the server closes */
-	current_game->temp_shm = shm_id;
+	lock_at(&shm->inv_lock, P_INVENTORY);
+	memcpy(inv, parsed, catalog.n * sizeof(int));
+	unlock_at(&shm->inv_lock, P_INVENTORY);
+	free(parsed);
+	return 0;
+}
 
-	return current_game;	// return pointer to shared memory segment
+/* new games copy the template, no disk I/O in the admission */
+void copy_inventory(game_t g) {
+	lock_at(&shm->inv_lock, P_INVENTORY);
+	memcpy(g->inv, inv_template, catalog.n * sizeof(int));
+	unlock_at(&shm->inv_lock, P_INVENTORY);
 }
 
-void read_inventory(char * fname) {
-	int i, num;
-	char word[MAX];		// holds each line
+/* the monitor process watches the inventory file's directory, */
+/* editors often replace the file instead of writing it, the */
+/* next game gets the changes */
+void watch_inventory() {
+	char buf[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+	struct inotify_event *ev;	// one change
+	char dir[MAX], *name;	// inventory file's directory and name
+	ssize_t n;
+	int fd;
+
+	if ((n = fork()) == -1) {
+		perror("fork()\nerrno"); exit(1);	// debugging
+	}
+	if (n > 0) {
+		return;		// parent
+	}
+	prctl(PR_SET_PDEATHSIG, SIGINT);	// die with the server
 
-	if ((fp = fopen(fname, "r")) == NULL) {
-		perror("File does not exist\nerrno"); _exit(1);	// debugging
+	strcpy(dir, inv_file);
+	if ((name = strrchr(dir, '/'))) {
+		*name++ = 0;	// dir/name
+		name = inv_file + (name - dir);
+	}
+	else {
+		strcpy(dir, ".");
+		name = inv_file;
 	}
-	fseek(fp, 0, SEEK_END);	// set position indicator to EOF
-	rewind(fp);		// set position indicator to beginning
 
-	while( fscanf(fp, "%s\t%d\n", word, &num) != EOF ) {
-		i = resource_id(word);	// hashing function
+	if ((fd = inotify_init1(IN_CLOEXEC)) == -1 ||
+			inotify_add_watch(fd, dir, IN_CLOSE_WRITE | IN_MOVED_TO) == -1) {
+		perror("inotify()\nerrno");	// debugging
+		_exit(1);		// no reloads, the server goes on
+	}
 
-		if (i == -1) {	// item does not exist
-			perror("Wrong inventory\nerrno"); _exit(1);
+	while ((n = read(fd, buf, sizeof(buf))) > 0 || (n == -1 && errno == EINTR)) {
+		for (ev = (struct inotify_event *) buf; (char *) ev < buf + n;
+				ev = (struct inotify_event *) ((char *) ev + sizeof(*ev) + ev->len)) {
+			if (ev->len && !strcmp(ev->name, name)) {
+				if (read_inventory(inv_file, inv_template) == 0) {
+					printf("Inventory reloaded, next games get it\n");
+				}
+				else {
+					printf("Inventory not reloaded, keeping the old one\n");
+				}
+			}
 		}
-		get_game(shm->game_num)->inv[i] = num;	// set inventory values
 	}
-	fclose(fp);		// close file
+	_exit(0);
+}
+
+/* the flusher process appends the new messages of every game */
+/* to the log every FLUSH ms, or as soon as a game is half a ring */
+/* ahead of it, reading the rings like drain does, the players' */
+/* processes never wait for it, what a game wrote over before it */
+/* came by is counted in the log instead */
+void flush_history() {
+	unsigned long head, pos, seq, lost;
+	struct chat_t *m;		// ring entry
+	char frame[PROTO_HDR + MAXCHAT];	// framed message
+	int i, len, stop;
+	game_t g;
+	pid_t pid;
+
+	if ((pid = fork()) == -1) {
+		perror("fork()\nerrno"); exit(1);	// debugging
+	}
+	if (pid > 0) {
+		flusher = pid;	// terminate waits for it
+		return;		// parent
+	}
+	prctl(PR_SET_PDEATHSIG, SIGINT);	// die with the server
+	signal(SIGINT, stop_flusher);	// after a last pass
+
+	if (hlog_open(&hlog, history_path) == -1) {
+		perror("hlog_open()\nerrno");	// debugging
+		_exit(1);		// no log, the server goes on
+	}
+
+	do {
+		stop = stop_flushing;
+		__atomic_store_n(&shm->log_bell, 0, __ATOMIC_RELEASE);	// ring again
+		for (i=1; i<=__atomic_load_n(&shm->game_num, __ATOMIC_ACQUIRE); i++) {
+			g = get_game(i);
+			head = __atomic_load_n(&g->head, __ATOMIC_ACQUIRE);
+			pos = g->logged;
+			lost = 0;
+			if (head - pos > RING) {
+				lost = head - RING - pos;
+				pos = head - RING;
+			}
+			for (; pos != head; pos++) {
+				m = &g->chat[pos % RING];
+				seq = __atomic_load_n(&m->seq, __ATOMIC_ACQUIRE);
+				if (seq < 2*pos + 2) {
+					break;		// still written, next pass
+				}
+				len = m->len;
+				if (seq > 2*pos + 2 || len < PROTO_HDR || len > (int) sizeof(frame)) {
+					lost++;		// written over
+					continue;
+				}
+				memcpy(frame, m->frame, len);
+				__atomic_thread_fence(__ATOMIC_ACQUIRE);
+				if (__atomic_load_n(&m->seq, __ATOMIC_RELAXED) != seq) {
+					lost++;		// written over while copying
+					continue;
+				}
+				if (hlog_append(&hlog, i, frame, len) == -1) {
+					perror("hlog_append()\nerrno");	// debugging
+					_exit(1);	// no more log
+				}
+			}
+			if (lost && hlog_lost(&hlog, i, lost) == -1) {
+				perror("hlog_lost()\nerrno");	// debugging
+				_exit(1);	// no more log
+			}
+			__atomic_store_n(&g->logged, pos, __ATOMIC_RELAXED);
+		}
+		if (!stop) {
+			futex_wait(&shm->log_bell, 0, FLUSH);
+		}
+	} while (!stop);
+	hlog_close(&hlog);
+	_exit(0);
 }
 
-int resource_id(char * res) {	// hashing function
-	return (!strcmp(res, "gold") ? 0 :
-			!strcmp(res, "armor") ? 1 :
-			!strcmp(res, "ammo") ? 2 :
-			!strcmp(res, "lumber") ? 3 :
-			!strcmp(res, "magic") ? 4 :
-			!strcmp(res, "rock") ? 5 : -1);
+void stop_flusher(int signo) {
+	stop_flushing = 1;	// the loop makes one more pass
 }
 
 /* this is the game */
 void action(int cl) {
 	int game_number;	// current game number
-	int timer = 0;		// for the 5 seconds timer
-	char buf[MAXBUF], message[MAXBUF];	// buffers
+	int joins;		// inserts into the game so far
+	long remind;		// next "Please wait..." (ms)
+	int slot;		// player's slot in the game
+	char frame[PROTO_HDR + MAXCHAT + 1];	// message for the others
+	size_t len;		// frame's length
+	frames_t in = {0};	// player's messages
+	char *text;		// player's message
+	int type, n;		// message type, bytes read
 	char name[MAX];		// player's name
+	struct pollfd pfd[3];	// player, doorbell and handoffs
+	struct signalfd_siginfo si;	// doorbell
+	peers_t *p;		// other players' descriptors
 	game_t g;		// current game struct
 
-	signal(SIGUSR1, send_msg);	// set signal handler
+	doorbell_fd();		// chat messages ring the doorbell
+	handoff_fd();		// other players' descriptors arrive here
 
 	memset(name, 0, MAX);					// set buffer to \0
 	/* try to insert player to server */
 	/* if successful, return player's game number and name */
-	game_number = insert_player(cl, name);
-
-	g = get_game(game_number);				// get current game
-
-	while(g->active < maxplayers) {	// till game is full
-		usleep(100000);				// every 0.1 sec checks
-		timer += 1;				// till it reaches 5 seconds
-		if (timer == 50) {			// 5 seconds
-			timer = 0;				// reset timer
-			send(cl, "Please wait...\n",16,0);	// waiting..
+	game_number = insert_player(cl, name, &in);
+
+	p = join_peers(game_number);
+	g = p->g;						// get current game
+	slot = player_slot(g, cl);				// player's slot
+	announce(p, slot);		// pass our player to the others
+
+	/* sleep on the game's count of inserts, every insert wakes */
+	/* us up, so we also pick up new players' descriptors, the */
+	/* count only grows, players who leave cannot hide a wake up */
+	/* a player who came back does not wait, START was replayed */
+	remind = now_us() / 1000 + REMIND;
+	while(!came_back) {
+		joins = __atomic_load_n(&g->joins, __ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&g->started, __ATOMIC_ACQUIRE)) {
+			break;			// till game is full
 		}
+		if (now_us() / 1000 >= remind) {	// 5 seconds
+			remind += REMIND;
+			proto_send(cl, MSG_WAIT, "Please wait...\n", 15, 0);	// waiting..
+		}
+		futex_wait(&g->joins, joins, remind - now_us() / 1000);
+		handoffs();				// new players' descriptors
+	}
+	if (!came_back) {
+		proto_send(cl, MSG_START, "START\n", 6, 0);	// send start message to players
+		printf("%s is ready!\n", name);	// players are ready!
 	}
-	usleep(100000);				// solves some bugs..
-	send(cl, "START\n", 7, 0);		// send start message to players
-	printf("%s is ready!\n", name);	// players are ready!
+
+	pfd[0].fd = cl;		// player's messages
+	pfd[0].events = POLLIN;
+	pfd[1].fd = sfd;	// other players' messages
+	pfd[1].events = POLLIN;
+	pfd[2].fd = hfd;	// late descriptors
+	pfd[2].events = POLLIN;
 
 	while (1) {	// chatting
-		memset(message, 0, MAXBUF);			// set message to \0
-		/* customize the message, so it shows who sent it */
-		strncat(message, name, strlen(name));
-		strncat(message, " : ", 4);
-
-		memset(buf, 0, MAXBUF);				// set buffer to 0
-		if(!recv(cl, buf, MAXBUF, 0)) {			// player crashed
-			remove_player(cl, game_number);		// kill player
+		if (poll(pfd, 3, -1) == -1) {
+			continue;	// interrupted by a signal
+		}
+
+		if (pfd[2].revents & POLLIN) {	// descriptors
+			handoffs();
+		}
+
+		if (pfd[1].revents & POLLIN) {	// doorbell
+			while (read(sfd, &si, sizeof(si)) > 0);	// rings are merged
+			drain(g, game_number, slot);	// send new messages to the player
+		}
+
+		if (!(pfd[0].revents & (POLLIN | POLLHUP))) {
+			continue;	// player said nothing
+		}
+
+		n = proto_read(cl, &in);
+		if (n == 0 || (n == -1 && errno != EINTR)) {	// player crashed
+			n = leave_game(cl, game_number);	// g is not ours anymore
 			printf("Player %s left..\n", name);	// inform the others
-			g->active--;			// decrease active players of game
-			if(g->active == 0) {	// empty game
+			if (n) {	// empty game
 				printf("All players left.\nGame Over\n\n");
 			}
 			_exit(1);	// kill player's process
 		}
 
-		strncat(message, buf, strlen(buf));	// for pretty code
-
-		/* each player's process only has the open file descriptors */
-		/* of the *previously* accepted players, so players */
-		/* cannot send messages directly to other players */
-		/* instead, they send the message to the server */
-		/* by sending a custom signal to the main process (parent) */
-		/* and the parent (server) then sends the message */
-		/* to the other players of the same game */
-		sem_wait(sem_id2);	// one message at a time
-		memset(shm->message, 0, MAXBUF);
-		strncpy(shm->message, message, strlen(message));
-		shm->client = cl;	// player that sends the message
-		shm->gamenum = game_number;	// the player's game
-		kill(getppid(), SIGUSR1);	// send signal!
-		usleep(100000);			// wait for others to receive
-		sem_post(sem_id2);	// all is good
+		/* one read may hold many messages, or only part of one */
+		while (proto_next(&in, &type, &text, &len)) {
+			if (type != MSG_CHAT) {
+				continue;	// players only chat now
+			}
+			/* customize the message, so it shows who sent it */
+			len = proto_printf(frame, MAXCHAT, MSG_CHAT, "%s : %.*s",
+					name, (int) len, text);
+			relay(g, game_number, slot, frame, len);
+		}
 	}
 }
 
-int insert_player(int cl, char *name) {
-	int i;
-	int ok=1, num, temp[6] = {0}, sum = 0;	// various flags and variables
-	char res[MAX], buf[MAXBUF], *line;	// buffers
-	game_t g;		// player's game
-	int game_number;	// game's number
+/* sends the message to all other players of the game */
+/* the message is written once to the game's ring, then sent */
+/* directly to every player whose descriptor we hold */
+/* the process serving each remaining player is woken up to */
+/* read it from the ring, a pending doorbell is not rung again */
+/* with -z the direct sends are spliced from a pipe, see zcopy.h */
+void relay(game_t g, int game_number, int from, char *frame, int len) {
+	peers_t *p = find_peers(game_number);	// our copies
+	int fd[maxplayers];		// where we send directly
+	unsigned long sent[SENT_WORDS(maxplayers)];	// slots we serve
+	unsigned long pos;		// ring position
+	struct chat_t *m;		// ring entry
+	int i, staged, direct = 0;
+
+	memset(sent, 0, sizeof(sent));
+	for (i=0; i<maxplayers; i++) {
+		fd[i] = 0;
+		if (!g->roster.fd[i] || i == from) {
+			continue;
+		}
+		fd[i] = g->owner[i] == getpid() ? g->roster.fd[i] : p ? peer_fd(p, i) : 0;
+		if (fd[i] && !take_writer(g, i)) {
+			fd[i] = 0;	// another process writes to him, see write_frame
+		}
+		if (fd[i]) {
+			sent[i / 64] |= 1ul << (i % 64);
+			direct++;
+		}
+	}
 
-	memset(buf, 0, MAXBUF);	// set buf to \0
+	pos = __atomic_fetch_add(&g->head, 1, __ATOMIC_ACQ_REL);	// claim
+	if (history_path && pos - __atomic_load_n(&g->logged, __ATOMIC_RELAXED) >= RING / 2 &&
+			!__atomic_exchange_n(&shm->log_bell, 1, __ATOMIC_ACQ_REL)) {
+		futex_wake(&shm->log_bell);	// the flusher comes by early
+	}
+	m = &g->chat[pos % RING];
+	__atomic_store_n(&m->seq, 2*pos + 1, __ATOMIC_RELAXED);	// writing
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	m->from = from;
+	memcpy(g->sent + (pos % RING) * SENT_WORDS(maxplayers), sent, sizeof(sent));
+	m->len = len;
+	memcpy(m->frame, frame, len);
+	__atomic_store_n(&m->seq, 2*pos + 2, __ATOMIC_RELEASE);	// done
+	stats_add(&shm->stats.chats, 1);
+	staged = zero_copy && direct && stage_chat(frame, len);
 
-	if (recv(cl, buf, MAXBUF, 0) == 0) {	// player crashes
-		printf("Could not add player..\n");
-		_exit(1);	// kill player's process
+	for (i=0; i<maxplayers; i++) {
+		if (fd[i]) {		// we have his descriptor
+			if (write_frame(g, game_number, i, fd[i], frame, len, staged) >= 0) {
+				stats_add(&shm->stats.bytes, len);
+			}
+		}
+		else if (g->roster.fd[i] && i != from &&
+				!__atomic_exchange_n(&g->bell[i], 1, __ATOMIC_ACQ_REL)) {
+			ring(g, game_number, i);	// read it from the ring
+		}
+	}
+	if (staged) {
+		zcopy_unstage(&zc);
 	}
+}
 
-	line = strtok (buf,"\n");		// get player's name
-	if (sscanf(line, "%s", name) != 1) {	// no name in first line
-		ok = 0;		// flag, player is not ok
+/* -z: the message goes into the worker's stage, opened the */
+/* first time, returns 0 if it must be copied as usual */
+int stage_chat(char *frame, int len) {
+	if (!zc_state) {
+		zc_state = zcopy_open(&zc) == 0 ? 1 : -1;
+		if (zc_state == -1) {
+			perror("zcopy_open()\nerrno");	// copies, as without -z
+		}
 	}
-	else {
-		line = strtok (NULL, "\n");	// next line
+	return zc_state == 1 && zcopy_stage(&zc, frame, len) == 0;
+}
+
+/* doorbell for the process serving the player in slot i */
+void ring(game_t g, int game_number, int i) {
+	union sigval who;		// doorbell payload
+
+	/* workers find the player by game and descriptor */
+	who.sival_ptr = (void *) ((long) game_number << 32 | g->roster.fd[i]);
+	sigqueue(g->owner[i], SIGRING, who);
+}
+
+/* the futex word lives in shared memory, so any process */
+/* that has the game attached can wait on it or wake it */
+void futex_wait(int *addr, int val, long ms) {
+	struct timespec ts;	// relative timeout
+
+	if (ms <= 0) {
+		return;		// already due
+	}
+	ts.tv_sec = ms / 1000;
+	ts.tv_nsec = (ms % 1000) * 1000000;
+	syscall(SYS_futex, addr, FUTEX_WAIT, val, &ts, NULL, 0);
+}
+
+void futex_wake(int *addr) {
+	syscall(SYS_futex, addr, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+}
+
+/* sends the player every message written after his cursor */
+/* it stops where another process is writing to him, that one */
+/* rings when it is done, and a worker where the socket is full */
+void drain(game_t g, int game_number, int i) {
+	unsigned long c = g->cursor[i];		// next position to read
+	unsigned long head, seq;
+	struct chat_t *m;		// ring entry
+	char frame[PROTO_HDR + MAXCHAT];	// framed message
+	int len;			// frame's length
+	int from;			// sender's slot
+	int served;			// the sender sent it to us
+	int n;				// what write_frame did
+
+	__atomic_store_n(&g->bell[i], 0, __ATOMIC_SEQ_CST);	// ring again, see nudge
+	head = __atomic_load_n(&g->head, __ATOMIC_ACQUIRE);
+	if (head - c > RING) {
+		c = head - RING;	// too slow, oldest messages are lost
 	}
 
-	while (line && ok) {	// till it reaches EOF or player is not ok
-		if ((sscanf(line, "%s\t%d", res, &num)) == 1) {
-			ok = 0;			// bad file
+	for (; c != head; c++) {
+		m = &g->chat[c % RING];
+		seq = __atomic_load_n(&m->seq, __ATOMIC_ACQUIRE);
+		if (seq < 2*c + 2) {
+			break;		// still written, its writer rings again
 		}
-		else {				// good file
-			if (((i = resource_id(res)) < 0) || (num <= 0)) {
-				ok = 0;		// invalid resource or invalid number
+		if (seq > 2*c + 2) {
+			continue;	// overwritten, lost
+		}
+		from = m->from;
+		served = g->sent[(c % RING) * SENT_WORDS(maxplayers) + i / 64] >> (i % 64) & 1;
+		len = m->len;
+		if (len < PROTO_HDR || len > (int) sizeof(frame)) {
+			continue;	// torn by a writer
+		}
+		memcpy(frame, m->frame, len);
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&m->seq, __ATOMIC_RELAXED) != seq) {
+			continue;	// overwritten while copying
+		}
+		if (from != i && !served && g->roster.fd[i]) {
+			if (!ask_writer(g, i)) {
+				break;		// read again when the writer is done
 			}
-			else {
-				temp[i] += num;		// player's request
-				sum += num;		// total resources
+			if ((n = write_frame(g, game_number, i, g->roster.fd[i], frame, len, 0)) >= 0) {
+				stats_add(&shm->stats.bytes, len);
+			}
+			if (n == 1) {
+				c++;		// its rest is kept, the next ones wait
+				break;
 			}
-
-			line = strtok (NULL, "\n");	// next line
 		}
-	}	// EOF
+	}
+	g->cursor[i] = c;
+}
 
-	sem_wait(sem_id);	// one insert at a time
+/* only the process that holds a slot's writer word writes to */
+/* its player, so two frames never mix on his socket, the others */
+/* leave the player's messages in the ring for his own process */
+/* meanwhile, workers (-w) never wait for one player: a frame */
+/* they could not finish keeps the word till the rest went out */
+int take_writer(game_t g, int slot) {
+	pid_t none = 0;
 
-	game_number = shm->game_num;	// current game number
-	g = get_game(game_number);	// get current game
+	return __atomic_compare_exchange_n(&g->writer[slot], &none, getpid(),
+			0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED);
+}
 
-	for (i=0; i<6; i++) {
-		if (g->inv[i] - temp[i] < 0) {	// checks if player is greedy
-			ok = 0;
+/* takes the word for the player's own process, if it is held */
+/* its holder is told to ring when done, by a negative pid */
+int ask_writer(game_t g, int slot) {
+	pid_t w = 0;
+
+	while (!__atomic_compare_exchange_n(&g->writer[slot], &w, w ? -w : getpid(),
+			0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+		if (w < 0) {
+			return 0;	// already asked
 		}
 	}
+	return !w;
+}
 
-	if( sum > quota ) {	// checks if player is too greedy
-		ok = 0;
+/* lets the slot go, unless a new player took it meanwhile, and */
+/* rings his process if it asked for the word meanwhile */
+void give_writer(game_t g, int game_number, int slot, int gen) {
+	pid_t me = getpid();
+
+	if (__atomic_load_n(&g->gen[slot], __ATOMIC_ACQUIRE) != gen) {
+		return;
+	}
+	if (!__atomic_compare_exchange_n(&g->writer[slot], &me, 0,
+			0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED) && me == -getpid()) {
+		__atomic_store_n(&g->writer[slot], 0, __ATOMIC_SEQ_CST);
+		nudge(g, game_number, slot, gen);
 	}
+}
 
-	if ( ok ) {		// player is approved by the server!
-		for (i=0; i<6; i++) {
-			g->inv[i] -= temp[i];		// decrease server's inventory
+/* writes a frame to the player in slot, whose writer word we */
+/* hold, a staged frame (-z) is spliced, returns 0 if all of it */
+/* went, 1 if the rest waits for the socket, we keep the word */
+/* then, -1 if none of it went, as for any slow player, without */
+/* workers the frame is written out whole, as it always was */
+int write_frame(game_t g, int game_number, int slot, int fd, const char *frame, size_t len, int staged) {
+	int gen = g->gen[slot];		// the player we write to
+	ssize_t n = -1;			// bytes the socket took
+
+	if (!workers) {
+		n = proto_write(fd, frame, len, 0) == 0 ? (ssize_t) len : -1;
+	}
+	else if (staged) {
+		n = zcopy_send(&zc, fd, len);
+	}
+	if (workers && n == -1) {
+		n = proto_try(fd, frame, len);
+	}
+	if (n > 0 && (size_t) n < len) {
+		keep_rest(fd, g, game_number, slot, gen, frame + n, len - n);
+		return 1;
+	}
+	give_writer(g, game_number, slot, gen);
+	return n > 0 ? 0 : -1;
+}
+
+void keep_rest(int fd, game_t g, int game_number, int slot, int gen, const char *rest, size_t len) {
+	struct epoll_event ev;	// writable interest
+	pend_t *p;
+
+	if (fd >= max_pend) {	// grow the table
+		if (!(p = realloc(pend, (fd + 1024) * sizeof(pend_t)))) {
+			perror("realloc()\nerrno");
+			shutdown(fd, SHUT_RDWR);	// torn frame
+			give_writer(g, game_number, slot, gen);
+			return;
 		}
-		send(cl, "OK\n", 4, 0);			// send ok message to player
-		/* save player's name for the pretty "show info" function */
-		memset(g->names[g->active], 0, MAX);
-		strncpy(g->names[g->active], name, strlen(name));
-		g->players[g->active++] = cl;	// save player's file descriptor
+		memset(p + max_pend, 0, (fd + 1024 - max_pend) * sizeof(pend_t));
+		pend = p;
+		max_pend = fd + 1024;
+	}
+	p = &pend[fd];
+	if (!(p->rest = malloc(len))) {
+		shutdown(fd, SHUT_RDWR);	// torn frame
+		give_writer(g, game_number, slot, gen);
+		return;
+	}
+	memcpy(p->rest, rest, len);
+	p->off = 0;
+	p->len = len;
+	p->g = g;
+	p->game_number = game_number;
+	p->slot = slot;
+	p->gen = gen;
+	/* our own player is in epoll already, a copy is added */
+	p->copy = g->owner[slot] != getpid() || g->roster.fd[slot] != fd;
+	ev.events = p->copy ? EPOLLOUT : EPOLLIN | EPOLLOUT;
+	ev.data.fd = fd;
+	epoll_ctl(epfd, p->copy ? EPOLL_CTL_ADD : EPOLL_CTL_MOD, fd, &ev);
+}
 
-		if (g->active >= maxplayers) {	// game is full!
-			shm->game_num++;		// next game
-			snprintf(buf, MAX, "%d", shm->game_num);
-			fp = fopen(buf, "a+");		// create next game's unique file
-			fclose(fp);			// close file
-			shm_key = ftok(buf, 'x');	// get unique key
+/* the socket is writable, or gone: the rest goes on, once it is */
+/* all out the player's process catches up with the ring */
+void flush_rest(int fd) {
+	pend_t *p = &pend[fd];
+	game_t g = p->g;
+	int game_number = p->game_number, slot = p->slot, gen = p->gen;
+	ssize_t n;
+
+	if ((n = proto_try(fd, p->rest + p->off, p->len - p->off)) == -1) {
+		drop_rest(fd);	// player gone
+		return;
+	}
+	if ((p->off += n) < p->len) {
+		return;		// the rest of the rest later
+	}
+	drop_rest(fd);
+	nudge(g, game_number, slot, gen);
+}
 
-			/* get shared memory id for the next game */
-			if ((shm_id = shmget(shm_key, sizeof(*g), IPC_CREAT | 0666)) == -1) {
-				perror("shmget()\nerrno"); _exit(1);	// debugging
-			}
+/* forgets the rest of fd's frame, if there is one, a frame cut */
+/* in half would break the stream, so the stream is shut */
+void drop_rest(int fd) {
+	struct epoll_event ev;	// back to reading only
+	pend_t *p;
 
-			/* attach shared memory segment to next game struct */
-			if ((long)(g->next = (game_t) (shmat(shm_id, (void *) 0, 0))) == -1) {
-				perror("shmat()\nerrno"); _exit(1);	// debugging
-			}
+	if (fd >= max_pend || !(p = &pend[fd])->rest) {
+		return;
+	}
+	if (p->off < p->len) {
+		shutdown(fd, SHUT_RDWR);	// torn frame
+	}
+	free(p->rest);
+	p->rest = NULL;
+	ev.events = EPOLLIN;
+	ev.data.fd = fd;
+	epoll_ctl(epfd, p->copy ? EPOLL_CTL_DEL : EPOLL_CTL_MOD, fd, &ev);
+	give_writer(p->g, p->game_number, p->slot, p->gen);
+}
 
-			/* set shared memory segment for destruction */
-			if (shmctl(shm_id , IPC_RMID , 0) == -1) {
-				perror("schctl()\nerrno"); _exit(1);	// debugging
-			}
+/* messages left in the ring while we wrote to the player, START */
+/* too, are sent by his own process, woken like for chat */
+void nudge(game_t g, int game_number, int slot, int gen) {
+	int cl = g->roster.fd[slot];	// the player
 
-			/* set initial values for next game */
-			g = g->next;
-			for (i=0; i<maxplayers; i++) {
-				g->players[i] = 0;	// file decriptors are 0
-			}
-			g->next = NULL;			// no next game
-			g->active = 0;			// no active player
-			/* each game has its own inventory */
-			read_inventory(inv_file);
+	if (!cl || __atomic_load_n(&g->gen[slot], __ATOMIC_ACQUIRE) != gen) {
+		return;		// gone
+	}
+	if (g->owner[slot] != getpid()) {
+		if (!__atomic_exchange_n(&g->bell[slot], 1, __ATOMIC_SEQ_CST)) {
+			ring(g, game_number, slot);
 		}
 	}
-	else {	// server disapproves of the player
-		send(cl, "Try next time..\n", 17, 0);	// send message..
-		printf("Could not add %s\n", name);	// sorry
-		sem_post(sem_id); 	// increase semaphore
-		_exit(1);		// kill player's process
+	else if (!workers) {
+		drain(g, game_number, slot);	// our one player, no conns
+	}
+	else if (conns[cl].state == CL_WAIT && g->started) {
+		start_player(cl);
 	}
+	else if (conns[cl].state == CL_PLAY) {
+		drain(g, game_number, slot);
+	}
+}
 
-	/****** player inserted to game ******/
-	sem_post(sem_id);		// next
+/* closes our copy of a player's descriptor, with its rest */
+void close_copy(int fd) {
+	drop_rest(fd);
+	close(fd);
+}
 
-	return game_number;		// return player's game number
+/* doorbells are read from a signalfd, not by a signal handler */
+void doorbell_fd() {
+	sigset_t mask;
+
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGRING);
+	sigprocmask(SIG_BLOCK, &mask, NULL);	// no handler, only the fd
+	if ((sfd = signalfd(-1, &mask, SFD_NONBLOCK)) == -1) {
+		perror("signalfd()\nerrno"); _exit(1);	// debugging
+	}
 }
 
-void remove_player(int cl, int game_number) {
-	int i;
-	game_t g = get_game(game_number);	// get player's game
+/* each serving process receives descriptors on a datagram socket */
+/* with an abstract name made of the server's and its own pid */
+void handoff_fd() {
+	struct sockaddr_un addr;	// our name
+	socklen_t len;
 
-	for (i=0; i<maxplayers; i++) {
-		if (g->players[i] == cl) {		// find player
-			g->players[i] = 0;		// and remove his file descriptor
-		}
+	if ((hfd = socket(AF_UNIX, SOCK_DGRAM | SOCK_NONBLOCK, 0)) == -1) {
+		perror("socket()\nerrno"); _exit(1);	// debugging
 	}
+	handoff_addr(getpid(), &addr, &len);
+	if (bind(hfd, (struct sockaddr *) &addr, len) == -1) {
+		perror("bind()\nerrno"); _exit(1);	// debugging
+	}
+}
+
+void handoff_addr(pid_t pid, struct sockaddr_un *addr, socklen_t *len) {
+	memset(addr, 0, sizeof(*addr));
+	addr->sun_family = AF_UNIX;
+	/* sun_path[0] = \0, no file in the directory */
+	snprintf(addr->sun_path + 1, sizeof(addr->sun_path) - 1,
+			"gameserver.%d.%d", mainpid, pid);
+	*len = sizeof(addr->sun_family) + 1 + strlen(addr->sun_path + 1);
+}
+
+/* passes fd of the player in slot to process "to" */
+/* if it fails, messages to that player go through the ring */
+void send_fd(pid_t to, int game_number, int slot, int gen, int reply, int fd) {
+	struct handoff_t h = { game_number, slot, gen, reply };
+	char control[CMSG_SPACE(sizeof(int))];	// the descriptor
+	struct sockaddr_un addr;	// receiver's name
+	struct iovec iov = { &h, sizeof(h) };
+	struct msghdr msg;
+	struct cmsghdr *cmsg;
+
+	memset(&msg, 0, sizeof(msg));
+	memset(control, 0, sizeof(control));
+	handoff_addr(to, &addr, &msg.msg_namelen);
+	msg.msg_name = &addr;
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof(control);
+	cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+	memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+
+	sendmsg(hfd, &msg, MSG_DONTWAIT);
+}
+
+/* passes the new player in slot to every process serving his game */
+/* they answer with their own players */
+void announce(peers_t *p, int slot) {
+	pid_t others[maxplayers];	// processes already told
+	game_t g = p->g;
+	int i, j, n = 0;
+
+	for (i=0; i<maxplayers; i++) {
+		if (!g->roster.fd[i] || g->owner[i] == getpid()) {
+			continue;
+		}
+		for (j=0; j<n && others[j] != g->owner[i]; j++);
+		if (j == n) {		// tell each process once
+			others[n++] = g->owner[i];
+			send_fd(g->owner[i], p->game_number, slot,
+					g->gen[slot], 0, g->roster.fd[slot]);
+		}
+	}
+}
+
+void handoffs() {
+	struct handoff_t h;		// what the descriptor is
+	char control[CMSG_SPACE(sizeof(int))];
+	struct iovec iov = { &h, sizeof(h) };
+	struct msghdr msg;
+	struct cmsghdr *cmsg;
+	peers_t *p;
+	game_t g;
+	int i, fd;
+
+	while (1) {
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+		msg.msg_control = control;
+		msg.msg_controllen = sizeof(control);
+		if (recvmsg(hfd, &msg, MSG_DONTWAIT) == -1) {
+			break;		// no more descriptors
+		}
+		cmsg = CMSG_FIRSTHDR(&msg);
+		if (!cmsg || cmsg->cmsg_type != SCM_RIGHTS) {
+			continue;	// no descriptor
+		}
+		memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+
+		p = find_peers(h.game_number);
+		if (!p || h.slot < 0 || h.slot >= maxplayers) {
+			close(fd);	// we do not serve that game anymore
+			continue;
+		}
+		if (p->fd[h.slot] && h.gen < p->gen[h.slot]) {
+			close(fd);	// late, from an older player of the slot
+			continue;
+		}
+		if (p->fd[h.slot]) {
+			close_copy(p->fd[h.slot]);	// older copy
+		}
+		p->fd[h.slot] = fd;
+		p->gen[h.slot] = h.gen;
+
+		if (!h.reply) {		// new player, send him ours
+			g = p->g;
+			for (i=0; i<maxplayers; i++) {
+				if (g->roster.fd[i] && g->owner[i] == getpid()) {
+					send_fd(g->owner[h.slot], h.game_number, i,
+							g->gen[i], 1, g->roster.fd[i]);
+				}
+			}
+		}
+	}
+}
+
+peers_t *find_peers(int game_number) {
+	peers_t *p = peer_table[game_number % PEERHASH];
+
+	while (p && p->game_number != game_number) {
+		p = p->next;
+	}
+	return p;
+}
+
+/* one more of our players in the game, the game is attached once */
+peers_t *join_peers(int game_number) {
+	peers_t *p = find_peers(game_number);
+
+	if (!p) {
+		if (!(p = calloc(1, sizeof(peers_t) + 2 * maxplayers * sizeof(int)))) {
+			perror("calloc()\nerrno"); _exit(1);	// debugging
+		}
+		p->fd = (int *) (p + 1);	// the slots follow
+		p->gen = p->fd + maxplayers;
+		p->game_number = game_number;
+		p->g = get_game(game_number);
+		p->next = peer_table[game_number % PEERHASH];
+		peer_table[game_number % PEERHASH] = p;
+	}
+	p->local++;
+	return p;
+}
+
+/* one less of our players in the game, the last one */
+/* closes our copies and detaches the game */
+void leave_peers(int game_number) {
+	peers_t **pp = &peer_table[game_number % PEERHASH];
+	peers_t *p;
+	int i;
+
+	while ((p = *pp) && p->game_number != game_number) {
+		pp = &p->next;
+	}
+	if (!p || --p->local > 0) {
+		return;
+	}
+	for (i=0; i<maxplayers; i++) {
+		if (p->fd[i]) {
+			close_copy(p->fd[i]);
+		}
+	}
+	*pp = p->next;
+	free(p);
+}
+
+/* our copy of the descriptor in slot, 0 if we have none */
+/* copies of players that left are closed */
+int peer_fd(peers_t *p, int i) {
+	if (p->fd[i] && p->gen[i] == p->g->gen[i]) {
+		return p->fd[i];
+	}
+	if (p->fd[i]) {
+		close_copy(p->fd[i]);	// the slot has a new player
+		p->fd[i] = 0;
+	}
+	return 0;
+}
+
+int insert_player(int cl, char *name, frames_t *in) {
+	int ok, sum = 0;	// various flags and variables
+	request_t req;		// player's resources
+	char *request;		// player's request
+	size_t len;		// request's length
+	int type;		// message type
+	int game_number;	// game's number
+
+	if (!proto_recv(cl, in, &type, &request, &len)) {	// player crashes
+		printf("Could not add player..\n");
+		_exit(1);	// kill player's process
+	}
+
+	ok = type == MSG_JOIN &&
+		catalog_parse(&catalog, quota, request, len, name, MAX, &req, &sum);	// read request
+
+	if (!(game_number = admit_player(cl, name, &req, sum, ok))) {
+		_exit(1);		// kill player's process
+	}
+	record_admission(accepted_at);	// accept-to-OK latency
+
+	return game_number;		// return player's game number
+}
+
+/* inserts an approved player to the current game */
+/* returns player's game number, or 0 if the server disapproves */
+int admit_player(int cl, char *name, request_t *req, int sum, int ok) {
+	int i;
+	game_t g;		// player's game
+	int game_number;	// game's number
+	int round;		// and its round
+	struct shard_t *shard;	// player's lobby
+
+	if( sum > quota ) {	// checks if player is too greedy
+		ok = 0;
+	}
+	if (ok && history && (game_number = rejoin_player(cl, name))) {
+		return game_number;	// back to a running game
+	}
+
+	shard = &shm->shard[__atomic_fetch_add(&shm->next_shard, 1, __ATOMIC_RELAXED) % nshards];
+
+	while ( ok ) {
+		/* the inventory is taken without the semaphore, the game's */
+		/* inventory is written before its number is published */
+		game_number = __atomic_load_n(&shard->game_number, __ATOMIC_ACQUIRE);
+		g = get_game(game_number);	// get current game
+		round = __atomic_load_n(&g->round, __ATOMIC_SEQ_CST);
+		if (round & 1) {
+			continue;	// a late look at a game being reused
+		}
+
+		if (!catalog_reserve(g->inv, req)) {	// checks if player is greedy
+			ok = 0;
+			break;
+		}
+
+		/* the semaphore only guards the slots */
+		lock_shard(shard);
+		if (shard->game_number != game_number || g->round != round) {
+			/* the game filled up meanwhile, try the next one, if */
+			/* it was even reused the inventory we took is gone, */
+			/* it is given back only to the round it was taken from */
+			unlock_at(&shard->lock, P_ADMIT);
+			if (__atomic_load_n(&g->round, __ATOMIC_SEQ_CST) == round) {
+				catalog_release(g->inv, req, req->n);
+			}
+			continue;
+		}
+		if (g->started) {	// the arena was used up
+			/* games finished since then may be reused */
+			i = next_game(shard);
+			unlock_at(&shard->lock, P_ADMIT);
+			catalog_release(g->inv, req, req->n);
+			if (i) {
+				continue;
+			}
+			ok = 0;
+		}
+		break;		// still the shard's game, keep the semaphore
+	}
+
+	if ( ok ) {		// player is approved by the server!
+		/* take the first free slot, waiting players may have left */
+		for (i=0; g->roster.fd[i]; i++);
+		/* save player's name for the pretty "show info" function */
+		memset(g->roster.name[i], 0, NAMELEN);
+		strncpy(g->roster.name[i], name, NAMELEN - 1);	// \0 kept
+		g->owner[i] = getpid();		// this process serves the player
+		g->cursor[i] = g->head;		// only new messages
+		g->bell[i] = 0;			// no doorbell yet
+		g->gen[i]++;			// copies of the old player are stale
+		g->writer[i] = 0;		// nobody writes to him yet
+		g->roster.fd[i] = cl;		// save player's file descriptor
+		if (__atomic_add_fetch(&g->active, 1, __ATOMIC_RELEASE) == 1) {	// one more player
+			stats_add(&shm->stats.games, 1);
+		}
+		stats_add(&shm->stats.players, 1);
+		stats_add(&shm->stats.admitted, 1);
+		if (g->active >= maxplayers) {	// game is full!
+			__atomic_store_n(&g->started, 1, __ATOMIC_RELEASE);
+		}
+		__atomic_add_fetch(&g->joins, 1, __ATOMIC_RELEASE);
+		futex_wake(&g->joins);		// waiting players check again
+
+		if (g->started && workers) {
+			for (i=0; i<maxplayers; i++) {
+				if (g->roster.fd[i] && g->owner[i] != getpid()) {
+					ring(g, game_number, i);	// START!
+				}
+			}
+		}
+
+		/* game is full, the shard takes the next game */
+		if (g->active >= maxplayers) {
+			next_game(shard);
+		}
+	}
+	else {	// server disapproves of the player
+		stats_add(&shm->stats.rejected, 1);
+		proto_send(cl, MSG_REJECT, "Try next time..\n", 16, 0);	// send message..
+		printf("Could not add %s\n", name);	// sorry
+		return 0;
+	}
+
+	/****** player inserted to game ******/
+	unlock_at(&shard->lock, P_ADMIT);		// next
+	proto_send(cl, MSG_OK, "OK\n", 3, 0);	// send ok message to player
+
+	return game_number;		// return player's game number
+}
+
+/* a player who left a running game comes back under the same */
+/* name (-m): the seat must be free and still have the name, in */
+/* the round of the game that started and is not over, then the */
+/* player keeps the resources taken the first time, gets OK, */
+/* START and what was said meanwhile (see replay_history), and */
+/* reads the ring from there on like everybody else */
+/* returns the game number, 0 if there is no seat to go back to */
+int rejoin_player(int cl, char *name) {
+	unsigned long seat;	// where the player sat
+	int game_number;
+	struct shard_t *shard;	// the game's lobby
+	game_t g;
+	int i;
+
+	lock_at(&shm->seat_lock, P_HISTORY);
+	seat = history_take(shm->seats, name);
+	unlock_at(&shm->seat_lock, P_HISTORY);
+	game_number = seat & 0xffffffff;
+	if (!game_number || game_number > maxgames) {
+		return 0;
+	}
+	g = get_game(game_number);
+	shard = &shm->shard[g->shard];	// the round is checked under its semaphore
+	lock_shard(shard);
+	if ((unsigned) g->round != seat >> 32 || shard->game_number == game_number || !g->active) {
+		unlock_at(&shard->lock, P_ADMIT);
+		return 0;	// the game is over, or was reused
+	}
+	for (i=0; i<maxplayers && (g->roster.fd[i] ||
+			strncmp(g->roster.name[i], name, NAMELEN)); i++);
+	if (i == maxplayers) {
+		unlock_at(&shard->lock, P_ADMIT);
+		return 0;	// somebody else's seat
+	}
+	g->owner[i] = getpid();		// this process serves the player
+	g->cursor[i] = g->head;		// older messages are replayed
+	g->bell[i] = 0;			// no doorbell yet
+	g->gen[i]++;			// copies of the old descriptor are stale
+	g->writer[i] = 0;		// nobody writes to him yet
+	g->roster.fd[i] = cl;
+	__atomic_add_fetch(&g->active, 1, __ATOMIC_RELEASE);
+	stats_add(&shm->stats.players, 1);
+	stats_add(&shm->stats.admitted, 1);
+	unlock_at(&shard->lock, P_ADMIT);
+
+	proto_send(cl, MSG_OK, "OK\n", 3, 0);	// send ok message to player
+	replay_history(g, game_number, i, cl);
+	printf("%s is back in game %d\n", name, game_number);
+	came_back = 1;
+	return game_number;
+}
+
+/* START and the last -m messages of this round before the seat */
+/* was taken back, in one write, the ring is read like drain does */
+void replay_history(game_t g, int game_number, int slot, int cl) {
+	static char buf[PROTO_HDR + 8 + RING * (PROTO_HDR + MAXCHAT)];	// START, then the messages
+	unsigned long pos, end = g->cursor[slot];	// positions replayed
+	unsigned long seq;
+	struct chat_t *m;		// ring entry
+	size_t n, start;		// bytes in buf, START's
+	int len;			// a frame's length
+
+	n = start = proto_printf(buf, 6, MSG_START, "START\n");
+	pos = end - g->hist_start > (unsigned long) history ? end - history : g->hist_start;
+	for (; pos != end; pos++) {
+		m = &g->chat[pos % RING];
+		seq = __atomic_load_n(&m->seq, __ATOMIC_ACQUIRE);
+		len = m->len;
+		if (seq != 2*pos + 2 || len < PROTO_HDR || len > PROTO_HDR + MAXCHAT) {
+			continue;	// still written, or written over
+		}
+		memcpy(buf + n, m->frame, len);
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&m->seq, __ATOMIC_RELAXED) == seq) {
+			n += len;	// not written over while copying
+		}
+	}
+	/* nobody else has his descriptor yet, the slot is ours */
+	if (take_writer(g, slot) && write_frame(g, game_number, slot, cl, buf, n, 0) >= 0) {
+		stats_add(&shm->stats.bytes, n - start);
+	}
+}
+
+/* takes a finished game, or else the next unused game of the */
+/* arena, 0 if there is none, the arena starts zeroed, so unused */
+/* games have no players and finished ones have none left */
+/* the free list is game_pop's stack, see game.h */
+int claim_game() {
+	int n;
+
+	if ((n = game_pop(&shm->free_games, game_link))) {
+		return n;
+	}
+
+	n = __atomic_load_n(&shm->game_num, __ATOMIC_RELAXED);
+	do {
+		if (n >= maxgames) {
+			return 0;	// arena is used up
+		}
+	} while (!__atomic_compare_exchange_n(&shm->game_num, &n, n+1,
+			0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED));
+	place_slots(n+1);	// its first round, the slots stay
+	return n+1;
+}
+
+/* the shard's game is full, it takes the next one (numbers are */
+/* shared by all shards), called with the shard's semaphore */
+/* returns the new game, 0 if the arena is used up and no game */
+/* has finished, then the shard's game stays full */
+int next_game(struct shard_t *shard) {
+	int n;
+	game_t g;
+
+	if (!(n = claim_game())) {
+		return 0;
+	}
+	/* set initial values for next game */
+	g = get_game(n);
+	g->shard = shard - shm->shard;
+	g->started = 0;
+	g->hist_start = g->head;	// the old messages are only left for the log
+	/* each game has its own inventory, the round is odd while it */
+	/* is copied, even once it is whole, late players that took */
+	/* from the old one see it change, see admit_player */
+	__atomic_add_fetch(&g->round, 1, __ATOMIC_SEQ_CST);	// odd, being copied
+	copy_inventory(g);
+	__atomic_add_fetch(&g->round, 1, __ATOMIC_SEQ_CST);	// even, ready
+	__atomic_store_n(&shard->game_number, n, __ATOMIC_RELEASE);	// next game
+	return n;
+}
+
+/* where game n links to the next finished one */
+int *game_link(int n) {
+	return &get_game(n)->next_free;
+}
+
+void free_game(int number) {
+	game_push(&shm->free_games, game_link(number), number);
+}
+
+/* removes the player, the last one of a started game gives it */
+/* back to be reused, returns 1 if the game is over */
+/* with -m a player who leaves a running game may come back */
+int leave_game(int cl, int game_number) {
+	game_t g = get_game(game_number);	// player's game
+	struct shard_t *shard = &shm->shard[g->shard];	// g may be reused once we give it back
+	int over = 0, i;
+
+	lock_at(&shard->lock, P_LEAVE);	// the slot becomes free
+	i = player_slot(g, cl);
+	if (history && i != -1 && shard->game_number != game_number && g->active > 1) {
+		lock_at(&shm->seat_lock, P_HISTORY);
+		history_keep(shm->seats, g->roster.name[i],
+				(unsigned long) (unsigned) g->round << 32 | game_number, stats_ns());
+		unlock_at(&shm->seat_lock, P_HISTORY);
+	}
+	remove_player(cl, game_number);	// kill player
+	if (--g->active == 0) {		// decrease active players of game
+		stats_add(&shm->stats.games, -1);
+		/* the shard's own game is still being filled */
+		if ((over = shard->game_number != game_number)) {
+			free_game(game_number);
+		}
+	}
+	stats_add(&shm->stats.players, -1);
+	unlock_at(&shard->lock, P_LEAVE);
+	return over;
+}
+
+/* accept-to-OK latency of an admitted player */
+void record_admission(long since) {
+	histo_add(&shm->stats.admission, now_us() - since);
+}
+
+/* the clock is read only when the semaphore is taken */
+void lock_shard(struct shard_t *shard) {
+	long t, now;
+
+	if (sem_trywait(&shard->lock) == 0) {
+		histo_add(&shm->stats.lock_wait, 0);	// no wait
+		if (profiling) {
+			t = stats_ns();
+			prof_taken(&shm->prof[prof_slot], prof_since, P_ADMIT, t, t);
+		}
+		return;
+	}
+	t = stats_ns();
+	sem_lock(&shard->lock);
+	now = stats_ns();
+	histo_add(&shm->stats.lock_wait, now - t);
+	if (profiling) {
+		prof_taken(&shm->prof[prof_slot], prof_since, P_ADMIT, t, now);
+	}
+}
+
+/* with -P the wait for the semaphore and the time it is held */
+/* are kept for the call site */
+void lock_at(sem_t *sem, int site) {
+	long t;
+
+	if (!profiling) {
+		sem_lock(sem);
+		return;
+	}
+	t = stats_ns();
+	sem_lock(sem);
+	prof_taken(&shm->prof[prof_slot], prof_since, site, t, stats_ns());
+}
+
+void unlock_at(sem_t *sem, int site) {
+	if (profiling) {
+		prof_released(&shm->prof[prof_slot], prof_since, site);
+	}
+	sem_post(sem);
+}
+
+void remove_player(int cl, int game_number) {
+	int i;
+	game_t g = get_game(game_number);	// get player's game
+
+	for (i=0; i<maxplayers; i++) {
+		/* workers may share file descriptor numbers */
+		if (g->roster.fd[i] == cl && g->owner[i] == getpid()) {	// find player
+			g->roster.fd[i] = 0;		// and remove his file descriptor
+		}
+	}
+}
+
+/* returns the slot of the player served by this process */
+int player_slot(game_t g, int cl) {
+	int i;
+
+	for (i=0; i<maxplayers; i++) {
+		if (g->roster.fd[i] == cl && g->owner[i] == getpid()) {
+			return i;
+		}
+	}
+	return -1;	// not in this game
+}
+
+void sem_lock(sem_t *sem) {
+	while (sem_wait(sem) == -1 && errno == EINTR);	// chat signals
+}
+
+/****** worker pool (-w) ******/
+
+/* parent only forks the workers and restarts the ones that die */
+void supervise() {
+	pid_t pid;
+	int i, fd, stat;
+
+	signal(SIGCHLD, SIG_DFL);	// we wait for the workers ourselves
+	for (i=0; i<3; i++) {	// workers never block on them
+		if ((fd = i == 0 ? server : i == 1 ? tcp_server : router) != -1) {
+			fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+		}
+	}
+
+	for (i=0; i<workers; i++) {
+		worker_pid[i] = spawn_worker(i);
+	}
+
+	while (1) {
+		if ((pid = waitpid(-1, &stat, 0)) == -1) {
+			if (errno == EINTR) continue;	// a signal or chat
+			perror("waitpid()\nerrno"); exit(1);	// debugging
+		}
+		for (i=0; i<workers && worker_pid[i] != pid; i++);
+		if (i == workers) {
+			continue;	// not a worker
+		}
+		printf("Worker %d died, restarting..\n", pid);
+		release_players(pid);	// its players are gone
+		worker_pid[i] = spawn_worker(i);
+	}
+}
+
+pid_t spawn_worker(int i) {
+	pid_t pid;
+
+	if ((pid = fork()) == -1) {
+		perror("fork()\nerrno"); exit(1);	// debugging
+	}
+	if (pid == 0) {		// child
+		prctl(PR_SET_PDEATHSIG, SIGINT);	// die with the server
+		prof_slot = i + 1;	// the worker's own profile
+		worker_loop();	// never returns
+	}
+	return pid;
+}
+
+/* frees the slots of every player served by a dead worker */
+void release_players(pid_t pid) {
+	struct shard_t *shard;	// game's shard
+	game_t g;
+	int i, j;
+
+	for (i=0; i<shm->game_num; i++) {
+		g = get_game(i+1);
+		shard = &shm->shard[g->shard];
+		lock_at(&shard->lock, P_LEAVE);	// no inserts meanwhile
+		for (j=0; j<maxplayers; j++) {
+			if (g->roster.fd[j] && g->owner[j] == pid) {
+				g->roster.fd[j] = 0;	// remove player
+				if (--g->active == 0) {	// decrease active players
+					stats_add(&shm->stats.games, -1);
+					if (shard->game_number != i+1) {
+						free_game(i+1);		// finished
+					}
+				}
+				stats_add(&shm->stats.players, -1);
+			}
+		}
+		unlock_at(&shard->lock, P_LEAVE);
+	}
+}
+
+/* each worker waits on the shared listening socket */
+/* and on all of its players with epoll */
+void worker_loop() {
+	struct epoll_event ev, events[MAXEVENTS];	// epoll events
+	struct rlimit rl;	// open files limit
+	int i, n, timeout;
+	int fd, copy;		// a socket with the rest of a frame
+
+	/* every idle player costs one file descriptor */
+	if (getrlimit(RLIMIT_NOFILE, &rl) == 0) {
+		rl.rlim_cur = rl.rlim_max;	// as many as we are allowed
+		setrlimit(RLIMIT_NOFILE, &rl);
+	}
+
+	if ((epfd = epoll_create1(0)) == -1) {
+		perror("epoll_create1()\nerrno"); _exit(1);	// debugging
+	}
+	/* only one worker wakes up for each new player */
+	for (i=0; i<3; i++) {	// Unix and TCP listening sockets, router
+		if ((ev.data.fd = i == 0 ? server : i == 1 ? tcp_server : router) == -1) {
+			continue;	// not in use
+		}
+		ev.events = EPOLLIN | EPOLLEXCLUSIVE;
+		if (epoll_ctl(epfd, EPOLL_CTL_ADD, ev.data.fd, &ev) == -1) {
+			perror("epoll_ctl()\nerrno"); _exit(1);	// debugging
+		}
+	}
+	doorbell_fd();		// chat messages ring the doorbell
+	ev.events = EPOLLIN;
+	ev.data.fd = sfd;
+	if (epoll_ctl(epfd, EPOLL_CTL_ADD, sfd, &ev) == -1) {
+		perror("epoll_ctl()\nerrno"); _exit(1);	// debugging
+	}
+	handoff_fd();		// other workers' descriptors arrive here
+	ev.data.fd = hfd;
+	if (epoll_ctl(epfd, EPOLL_CTL_ADD, hfd, &ev) == -1) {
+		perror("epoll_ctl()\nerrno"); _exit(1);	// debugging
+	}
+
+	while (1) {
+		/* sleep until a socket is ready or a reminder is due */
+		timeout = -1;		// no waiting players, no timeout
+		if (wait_head != -1) {
+			timeout = conns[wait_head].deadline - now_us() / 1000;
+			if (timeout < 0) timeout = 0;
+		}
+		n = epoll_wait(epfd, events, MAXEVENTS, timeout);
+		if (n == -1 && errno != EINTR) {	// signals interrupt
+			perror("epoll_wait()\nerrno"); _exit(1);	// debugging
+		}
+
+		for (i=0; i<n; i++) {
+			if (events[i].data.fd == server || events[i].data.fd == tcp_server) {
+				accept_players(events[i].data.fd);	// new players
+			}
+			else if (events[i].data.fd == router) {
+				route_players();	// new players too
+			}
+			else if (events[i].data.fd == sfd) {
+				doorbells();		// chat messages
+			}
+			else if (events[i].data.fd == hfd) {
+				handoffs();		// other workers' players
+			}
+			else if ((fd = events[i].data.fd) < max_pend && pend[fd].rest) {
+				copy = pend[fd].copy;	// not our player's
+				if (events[i].events & (EPOLLOUT | EPOLLERR | EPOLLHUP)) {
+					flush_rest(fd);	// the rest of a frame
+				}
+				if (!copy && events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP)) {
+					player_event(fd);
+				}
+			}
+			else {
+				player_event(events[i].data.fd);
+			}
+		}
+		remind_players();	// "Please wait..." messages
+	}
+}
+
+void accept_players(int listener) {
+	int new_fd;		// player's file descriptor
+
+	while ((new_fd = accept4(listener, NULL, NULL, SOCK_NONBLOCK)) != -1) {
+		if (listener == tcp_server) {
+			tcp_nodelay(new_fd);	// chat leaves at once
+		}
+		open_conn(new_fd);
+	}
+	if (errno != EAGAIN && errno != EWOULDBLOCK) {
+		perror("accept()\nerrno");	// out of descriptors, try later
+	}
+}
+
+/* the workers share the router's link like a listener, every */
+/* packet is one player so each goes to exactly one worker */
+void route_players() {
+	int new_fd;		// player's file descriptor
+
+	while ((new_fd = router_recv_fd(router)) != -1) {
+		stats_add(&shm->stats.routed, 1);
+		fcntl(new_fd, F_SETFL, fcntl(new_fd, F_GETFL) | O_NONBLOCK);
+		open_conn(new_fd);
+	}
+	if (errno == EPIPE) {
+		printf("Router closed, no more players\n");
+		epoll_ctl(epfd, EPOLL_CTL_DEL, router, NULL);	// reports fail quietly
+	}
+}
+
+void open_conn(int new_fd) {
+	struct epoll_event ev;	// epoll event
+	conn_t *c;		// player's connection
+
+	if (new_fd >= max_conns) {	// grow connections table
+		c = realloc(conns, (new_fd + 1024) * sizeof(conn_t));
+		if (!c) {
+			perror("realloc()\nerrno"); close(new_fd); return;
+		}
+		conns = c;
+		max_conns = new_fd + 1024;
+	}
+	c = &conns[new_fd];
+	memset(c, 0, sizeof(conn_t));
+	c->state = CL_JOIN;		// waits for player's request
+	c->accepted = now_us();		// for the latency stats
+	c->prev = c->next = -1;
+
+	ev.events = EPOLLIN;
+	ev.data.fd = new_fd;
+	if (epoll_ctl(epfd, EPOLL_CTL_ADD, new_fd, &ev) == -1) {
+		perror("epoll_ctl()\nerrno"); close(new_fd);
+	}
+}
+
+void player_event(int cl) {
+	conn_t *c = &conns[cl];	// player's connection
+	int i, n;
+	int ok, sum;		// player's request
+	request_t req;		// player's resources
+	char frame[PROTO_HDR + MAXCHAT + 1];	// message for the others
+	size_t len;		// payload's, then frame's length
+	char *text;		// player's message
+	int type;		// message type
+
+	n = proto_read(cl, &c->in);
+	if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+		return;		// nothing to read after all
+	}
+	if (n <= 0) {		// player crashed
+		drop_player(cl);
+		return;
+	}
+
+	/* one read may hold many messages, or only part of one */
+	while (proto_next(&c->in, &type, &text, &len)) {
+		switch (c->state) {
+		case CL_JOIN:		// first message is the request
+			sum = 0;
+			ok = type == MSG_JOIN &&
+				catalog_parse(&catalog, quota, text, len, c->name, MAX, &req, &sum);
+			if (!(c->game_number = admit_player(cl, c->name, &req, sum, ok))) {
+				drop_player(cl);	// server disapproves
+				return;
+			}
+			record_admission(c->accepted);	// accept-to-OK latency
+			c->g = join_peers(c->game_number)->g;	// attached once
+			c->slot = player_slot(c->g, cl);
+			announce(find_peers(c->game_number), c->slot);
+			if (came_back) {	// START was replayed
+				came_back = 0;
+				c->state = CL_PLAY;
+				break;
+			}
+			c->state = CL_WAIT;
+			wait_push(cl);		// waits for the other players
+			if (c->g->started) {	// we filled the game
+				for (i=0; i<maxplayers; i++) {
+					if (c->g->roster.fd[i] && c->g->owner[i] == getpid()) {
+						start_player(c->g->roster.fd[i]);
+					}
+				}
+			}
+			break;
+
+		case CL_WAIT:		// players do not talk before START
+			break;
+
+		case CL_PLAY:		// chatting
+			if (type != MSG_CHAT) {
+				break;	// players only chat now
+			}
+			/* customize the message, so it shows who sent it */
+			len = proto_printf(frame, MAXCHAT, MSG_CHAT, "%s : %.*s",
+					c->name, (int) len, text);
+			relay(c->g, c->game_number, c->slot, frame, len);
+			break;
+		}
+	}
+}
+
+/* each doorbell names the game and one of our players in it */
+void doorbells() {
+	struct signalfd_siginfo si;	// doorbell
+	int game_number, cl;
+	conn_t *c;
+
+	while (read(sfd, &si, sizeof(si)) == sizeof(si)) {
+		game_number = si.ssi_ptr >> 32;
+		cl = si.ssi_ptr & 0xffffffff;
+		if (cl >= max_conns) {
+			continue;	// not ours anymore
+		}
+		c = &conns[cl];
+		if (c->state == CL_WAIT && c->game_number == game_number &&
+				c->g->started) {
+			start_player(cl);	// the game is full
+		}
+		else if (c->state == CL_PLAY && c->game_number == game_number) {
+			drain(c->g, c->game_number, c->slot);	// send new messages
+		}
+	}
+}
+
+void start_player(int cl) {
+	conn_t *c = &conns[cl];	// player's connection
+
+	char frame[PROTO_HDR + 6];	// START
+
+	if (c->state != CL_WAIT) {
+		return;		// already started
+	}
+	if (!take_writer(c->g, c->slot)) {
+		return;		// its writer starts him when done, see nudge
+	}
+	wait_pop(cl);		// leaves the waiting room
+	c->state = CL_PLAY;
+	write_frame(c->g, c->game_number, c->slot, cl,
+			frame, proto_pack(frame, MSG_START, "START\n", 6), 0);	// send start message
+	printf("%s is ready!\n", c->name);	// players are ready!
+}
+
+/* waiting players get a reminder every REMIND ms */
+/* everybody waits for the same time, so the list stays sorted */
+void remind_players() {
+	long now = now_us() / 1000;	// ms
+	char frame[PROTO_HDR + 15];	// the reminder
+	conn_t *c;
+	int cl;
+
+	while ((cl = wait_head) != -1 && (c = &conns[cl])->deadline <= now) {
+		if (take_writer(c->g, c->slot)) {	// or skipped, the socket is busy
+			write_frame(c->g, c->game_number, c->slot, cl,
+					frame, proto_pack(frame, MSG_WAIT, "Please wait...\n", 15), 0);	// waiting..
+		}
+		wait_pop(cl);
+		wait_push(cl);		// back of the queue
+	}
+}
+
+void drop_player(int cl) {
+	conn_t *c = &conns[cl];	// player's connection
+
+	if (c->state != CL_JOIN) {
+		wait_pop(cl);			// if still waiting
+		printf("Player %s left..\n", c->name);	// inform the others
+		if (leave_game(cl, c->game_number)) {	// empty game
+			printf("All players left.\nGame Over\n\n");
+		}
+		leave_peers(c->game_number);	// may detach the game
+	}
+	else if (!c->name[0]) {		// no request at all
+		printf("Could not add player..\n");
+	}
+	proto_free(&c->in);	// unread messages
+	drop_rest(cl);		// what he did not read
+	/* other workers' copies would keep it in our epoll */
+	epoll_ctl(epfd, EPOLL_CTL_DEL, cl, NULL);
+	close(cl);
+	c->state = CL_JOIN;
+}
+
+void wait_push(int cl) {
+	conn_t *c = &conns[cl];
+
+	c->deadline = now_us() / 1000 + REMIND;	// next reminder
+	c->prev = wait_tail;
+	c->next = -1;
+	if (wait_tail != -1) {
+		conns[wait_tail].next = cl;
+	}
+	else {
+		wait_head = cl;
+	}
+	wait_tail = cl;
+}
+
+void wait_pop(int cl) {
+	conn_t *c = &conns[cl];
+
+	if (c->state != CL_WAIT) {
+		return;		// not in the waiting room
+	}
+	if (c->prev != -1) conns[c->prev].next = c->next;
+	else wait_head = c->next;
+	if (c->next != -1) conns[c->next].prev = c->prev;
+	else wait_tail = c->prev;
+	c->prev = c->next = -1;
+}
+
+long now_us() {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
 }
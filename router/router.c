@@ -0,0 +1,275 @@
+#define _GNU_SOURCE	// for accept4
+#include <stdio.h>	// standard input/output
+#include <stdlib.h>	// general purpose functions
+#include <string.h>	// string operations
+#include <unistd.h>	// miscellaneous functions
+#include <sys/un.h>	// for sockaddr_un structure
+#include <sys/socket.h>	// socket definitions
+#include <sys/types.h>	// various type definitions
+#include <sys/epoll.h>	// waits on every socket at once
+#include <sys/resource.h>	// for the open files limit
+#include <signal.h>	// for handling signals
+#include <fcntl.h>	// file control options
+#include <errno.h>	// for the errno variable
+#include "../common/net.h"	// TCP players
+#include "../common/router.h"	// the link to the backends
+
+#define PATH "server"		// players connect here, as to a gameserver
+#define BACKENDS "router"	// backends connect here (-u router)
+#define MAXBACKENDS 64		// max gameservers behind the router
+#define MAXLISTEN 50		// max queue length for listen
+#define MAXEVENTS 256		// max events per epoll_wait
+
+/* the front door: players connect to the router as they would to a */
+/* gameserver, the router passes each one, before reading a byte, */
+/* to the least loaded backend, which serves him from then on */
+typedef struct backend_t {	// a gameserver behind the router
+	int fd;			// its link, -1 = free entry
+	load_t load;		// its last report
+	long sent;		// players we handed it
+	int stalled;		// its link was full, skipped until it reports
+} backend_t;
+
+backend_t backends[MAXBACKENDS];	// the gameservers
+int nbackends;		// entries in use
+int server;		// players' Unix socket
+int tcp_server = -1;	// players' TCP socket (-t), -1 = none
+char *tcp_addr;		// its [host:]port
+int backend_server;	// backends' socket
+char *backends_path = BACKENDS;	// its name
+int epfd;		// epoll file descriptor
+long turned_away;	// players no backend could take
+
+void terminate(int);		// signal handler for ctrl-c
+void init_router(void);		// opens the sockets
+int listen_unix(char *, int, int);	// a Unix listening socket
+void accept_backends(void);	// a gameserver joins
+void backend_event(int);	// a report, or a backend leaves
+void route_players(int);	// hands every pending player over
+backend_t *pick_backend(void);	// the least loaded backend
+int lighter(backend_t *, backend_t *);	// compares two backends' loads
+
+// ./router -t 5000
+
+int main(int argc, char *argv[]) {
+	struct epoll_event events[MAXEVENTS];	// epoll events
+	struct rlimit rl;	// open files limit
+	int i, n, fd;
+
+	for (i=1; i<argc; i++) {	// every argument is optional
+		if (!strcmp(argv[i], "-t") && i+1 < argc) {
+			tcp_addr = argv[++i];	// players over the network too
+		}
+		else if (!strcmp(argv[i], "-b") && i+1 < argc) {
+			backends_path = argv[++i];	// where the backends connect
+		}
+		else {
+			printf("Run the router by writing:\n");
+			printf("./router [-t <[host:]port>] [-b <backends_socket>]\n");
+			exit(1);
+		}
+	}
+
+	/* players are only passed through, but a burst of them may */
+	/* wait here for a backend */
+	if (getrlimit(RLIMIT_NOFILE, &rl) == 0) {
+		rl.rlim_cur = rl.rlim_max;	// as many as we are allowed
+		setrlimit(RLIMIT_NOFILE, &rl);
+	}
+	init_router();
+
+	printf("\n~~~~~ Router Started! ~~~~~\n");
+	printf("\n~~~ Start the gameservers with -u %s ~~~\n\n", backends_path);
+
+	while (1) {
+		if ((n = epoll_wait(epfd, events, MAXEVENTS, -1)) == -1) {
+			if (errno == EINTR) continue;	// signals interrupt
+			perror("epoll_wait()\nerrno"); exit(1);	// debugging
+		}
+		for (i=0; i<n; i++) {
+			fd = events[i].data.fd;
+			if (fd == server || fd == tcp_server) {
+				route_players(fd);	// new players
+			}
+			else if (fd == backend_server) {
+				accept_backends();	// new gameservers
+			}
+			else {
+				backend_event(fd);
+			}
+		}
+	}
+	return 0;	// unreachable
+}
+
+void terminate(int signo) {		// close router!
+	printf("\n~~~~~ Router Closing! ~~~~~\n\n");
+	remove(PATH);			// remove router files
+	remove(backends_path);
+	exit(0);
+}
+
+void init_router() {
+	struct epoll_event ev;	// epoll event
+	int i;
+
+	if ( signal(SIGINT, terminate) == SIG_ERR ) {
+		perror("signal()\nerrno"); exit(1);	// debugging
+	}
+	signal(SIGPIPE, SIG_IGN);	// backends may go away while we send
+
+	for (i=0; i<MAXBACKENDS; i++) {
+		backends[i].fd = -1;	// free
+	}
+	server = listen_unix(PATH, SOCK_STREAM, SOMAXCONN);
+	backend_server = listen_unix(backends_path, SOCK_SEQPACKET, MAXLISTEN);
+
+	/* players on other machines (-t), same protocol */
+	if (tcp_addr && (tcp_server = tcp_listen(tcp_addr, SOMAXCONN)) == -1) {
+		perror("tcp_listen()\nerrno"); exit(1);	// debugging
+	}
+
+	if ((epfd = epoll_create1(0)) == -1) {
+		perror("epoll_create1()\nerrno"); exit(1);	// debugging
+	}
+	for (i=0; i<3; i++) {	// the three listening sockets
+		if ((ev.data.fd = i == 0 ? server : i == 1 ? tcp_server : backend_server) == -1) {
+			continue;	// no TCP
+		}
+		fcntl(ev.data.fd, F_SETFL, fcntl(ev.data.fd, F_GETFL) | O_NONBLOCK);
+		ev.events = EPOLLIN;
+		if (epoll_ctl(epfd, EPOLL_CTL_ADD, ev.data.fd, &ev) == -1) {
+			perror("epoll_ctl()\nerrno"); exit(1);	// debugging
+		}
+	}
+}
+
+int listen_unix(char *path, int type, int backlog) {
+	struct sockaddr_un addr;	// Unix domain sockets
+	int fd;
+
+	memset(&addr, 0, sizeof(struct sockaddr_un));
+	addr.sun_family = AF_UNIX;
+	strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+
+	if ((fd = socket(AF_UNIX, type | SOCK_CLOEXEC, 0)) == -1) {
+		perror("socket()\nerrno"); exit(1);	// debugging
+	}
+	remove(path);	// remove file if already exists
+	if (bind(fd, (struct sockaddr *) &addr, sizeof(struct sockaddr_un)) == -1 ||
+			listen(fd, backlog) == -1) {
+		perror("bind()\nerrno"); exit(1);	// debugging
+	}
+	return fd;
+}
+
+/* a backend counts once its first report has arrived */
+void accept_backends() {
+	struct epoll_event ev;	// epoll event
+	int fd, i;
+
+	while ((fd = accept4(backend_server, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) != -1) {
+		for (i=0; i<MAXBACKENDS && backends[i].fd != -1; i++);
+		if (i == MAXBACKENDS) {
+			printf("Too many backends, max %d\n", MAXBACKENDS);
+			close(fd);
+			continue;
+		}
+		memset(&backends[i], 0, sizeof(backend_t));
+		backends[i].fd = fd;
+		if (i >= nbackends) {
+			nbackends = i + 1;
+		}
+		ev.events = EPOLLIN;
+		ev.data.fd = fd;
+		if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+			perror("epoll_ctl()\nerrno"); close(fd);
+			backends[i].fd = -1;
+		}
+	}
+}
+
+/* reads every waiting report, the last one wins */
+void backend_event(int fd) {
+	backend_t *b;
+	load_t load;
+	ssize_t n;
+
+	for (b = backends; b < backends + nbackends && b->fd != fd; b++);
+	if (b == backends + nbackends) {
+		return;		// already gone
+	}
+	while ((n = recv(fd, &load, sizeof(load_t), 0)) == sizeof(load_t)) {
+		if (!b->load.pid) {
+			printf("Backend %d joined\n", load.pid);
+		}
+		b->load = load;
+		b->stalled = 0;
+	}
+	if (n == 0 || (n == -1 && errno != EAGAIN && errno != EWOULDBLOCK)) {
+		printf("Backend %d left\n", b->load.pid);
+		close(fd);	// leaves the epoll set too
+		b->fd = -1;
+	}
+}
+
+/* players are passed before they send anything, the backend */
+/* reads their requests as if it had accepted them itself */
+void route_players(int listener) {
+	backend_t *b;
+	int fd;
+
+	while ((fd = accept4(listener, NULL, NULL, SOCK_CLOEXEC)) != -1) {
+		if (listener == tcp_server) {
+			tcp_nodelay(fd);	// chat leaves at once
+		}
+		/* a backend that can not take him now is skipped */
+		while ((b = pick_backend()) && router_send_fd(b->fd, fd) == -1) {
+			b->stalled = 1;
+		}
+		if (b) {
+			b->sent++;
+		}
+		else if (turned_away++ % 1000 == 0) {
+			printf("No backend for new players, %ld turned away\n", turned_away);
+		}
+		close(fd);	// the backend has its own copy
+	}
+	if (errno != EAGAIN && errno != EWOULDBLOCK) {
+		perror("accept()\nerrno");	// out of descriptors, try later
+	}
+}
+
+backend_t *pick_backend() {
+	backend_t *b, *best = NULL;
+
+	for (b = backends; b < backends + nbackends; b++) {
+		if (b->fd == -1 || !b->load.pid || b->stalled) {
+			continue;	// free, not reported yet or full
+		}
+		if (!best || lighter(b, best)) {
+			best = b;
+		}
+	}
+	return best;
+}
+
+/* first the backends whose games still have resources, since */
+/* the others turn every player away, then the fewest players, */
+/* counting the ones handed over after its last report, then */
+/* the fewest games and the most resources left */
+int lighter(backend_t *a, backend_t *b) {
+	long pa = a->load.players + a->sent - a->load.routed;
+	long pb = b->load.players + b->sent - b->load.routed;
+
+	if ((a->load.inventory > 0) != (b->load.inventory > 0)) {
+		return a->load.inventory > 0;
+	}
+	if (pa != pb) {
+		return pa < pb;
+	}
+	if (a->load.games != b->load.games) {
+		return a->load.games < b->load.games;
+	}
+	return a->load.inventory > b->load.inventory;
+}
@@ -6,16 +6,18 @@
 #include <sys/socket.h>	// socket definitions
 #include <sys/types.h>	// various type definitions
 #include <signal.h>	// for handling signals
+#include "../common/proto.h"	// framed messages
+#include "../common/net.h"	// Unix or TCP server
 
 #define MAX 16		// max size for small buffers
-#define MAXBUF 128	// max size for large buffers
 
 int server;		// server file descriptor
 char name[MAX];		// player's name
 char inv_file[MAX];	// inventory file
-char server_name[MAX];	// server hostname
+char server_name[108];	// socket path or host:port
+frames_t in;		// server's messages, maybe partial
 
-void read_inventory(char *, char *);	// reads inventory file
+char *read_inventory(char *, size_t *);	// reads inventory file
 void init_player(void);		// connects player with server
 void terminate(void);		// kills player
 void send_request(void);	// sends player's request to server
@@ -30,7 +32,7 @@ int main(int argc, char *argv[]) {
 	/* checks if all arguments are OK */
 	if (argc != 6) {
 		printf("Start playing by writing:\n");
-		printf("./player –n <name> -i <inventory> <server_host>\n");
+		printf("./player –n <name> -i <inventory> <server_host | host:port>\n");
 		exit(1);
 	}
 
@@ -47,7 +49,7 @@ int main(int argc, char *argv[]) {
 	else {
 		printf("Argument 3 must be -i\n"); exit(1);
 	}
-	strncpy(server_name, argv[5], strlen(argv[5]));		// server hostname
+	strncpy(server_name, argv[5], sizeof(server_name) - 1);	// server hostname
 
 
 	init_player();	// connect to server
@@ -63,20 +65,8 @@ int main(int argc, char *argv[]) {
 }
 
 void init_player() {
-	struct sockaddr_un srv_addr;	// Unix domain sockets
-
-	/* set all bytes to 0 */
-	memset(&srv_addr, 0, sizeof(struct sockaddr_un));
-	srv_addr.sun_family = AF_UNIX; // Local
-	strncpy(srv_addr.sun_path, server_name,
-			sizeof(srv_addr.sun_path) - 1);	// server hostname
-
-	if ((server = socket(AF_UNIX, SOCK_STREAM, 0)) == -1) {
-		perror("socket()\nerrno"); exit(1);	// debugging
-	}
-
-	if (connect(server, (struct sockaddr *) &srv_addr, sizeof(struct sockaddr)) == -1)  
-	{  
+	/* a path is a Unix domain socket, host:port is TCP */
+	if ((server = net_connect(server_name)) == -1) {
 		perror("connect()\nerrno"); exit(1);	// debugging
 	}
 
@@ -90,37 +80,35 @@ void terminate(void) {	// server ctrl-c or crash
 }
 
 void send_request() {
-	char mes[MAXBUF];	// player's request
+	char *mes;		// player's request
+	size_t size;		// request's length
+	char *text;		// server's message
+	size_t len;		// message's length
+	int type;		// message type
 	int ready=0;		// flag for START
 
-	memset(mes, 0, MAXBUF);			// set string to 0 (\0)
-	read_inventory(inv_file, mes);		// reads player's request
-	send(server, mes, strlen(mes), 0);	// send request
+	mes = read_inventory(inv_file, &size);	// reads player's request
+	proto_send(server, MSG_JOIN, mes, size, 0);	// send request
+	free(mes);
 
-	if (recv(server, mes, MAXBUF, 0) == 0) {
-		terminate();		// server crashes
-	}
-	if (strcmp(mes, "OK\n")) {
-		printf("%s", mes);
-		exit(1);			// server does not approve
-	}
-	else printf("%s", mes);	// OK
-
-	while (!ready) {			// wait for START signal
-		memset(mes, 0, MAXBUF);		// set string to \0
-		if (recv(server, mes, MAXBUF, 0) == 0) {
-			terminate();		// server crashes
+	while (!ready) {		// wait for OK, then START
+		if (!proto_recv(server, &in, &type, &text, &len)) {
+			terminate();	// server crashes
+		}
+		printf("%.*s", (int) len, text);	// print server's message
+		if (type == MSG_REJECT) {
+			exit(1);	// server does not approve
 		}
-		if (!strcmp(mes, "START\n")) {
-			ready = 1;		// game starts!
+		if (type == MSG_START) {
+			ready = 1;	// game starts!
 		}
-		printf("%s", mes);		// print server's message
 	}
 }	// player is OK, game starts!
 
-void read_inventory(char *fname, char *mes) {
+char *read_inventory(char *fname, size_t *size) {
 	FILE *fp;
-	int len;		// file's length (bytes)
+	long len;		// file's length (bytes)
+	char *mes;		// player's request
 	char inv_name[MAX];	// player's name (first line in inventory)
 
 	if ((fp = fopen(fname, "r")) == NULL) {			// open file
@@ -129,6 +117,12 @@ void read_inventory(char *fname, char *mes) {
 	fseek(fp, 0, SEEK_END);	// set position indicator to EOF
 	len = ftell(fp);	// total chars
 	rewind(fp);		// set position indicator to beginning
+	if (len > PROTO_MAX) {
+		len = PROTO_MAX;	// the request is one message
+	}
+	if (!(mes = malloc(len + 1))) {
+		perror("malloc()\nerrno"); exit(1);	// debugging
+	}
 
 	if ( fscanf(fp, "%s\n", inv_name) == EOF || strcmp(name, inv_name)) {
 		/* argv[2] must be the same with inventory's first line */
@@ -136,26 +130,27 @@ void read_inventory(char *fname, char *mes) {
 	}
 
 	rewind(fp);				// set indicator to beginning			
-	fread(mes, len, sizeof(char), fp);	// read message!
+	*size = fread(mes, sizeof(char), len, fp);	// read message!
 	fclose(fp);				// close file
+	return mes;
 }	// reading inventory file complete!
 
 void* cl_write(void * value) {	// constant writing
-	char mes[MAXBUF];	// player's message
-	while (1) {		// always waits for input
-		memset(mes, 0, MAXBUF);			// set buffer to \0
-		fgets(mes, MAXBUF-1, stdin);		// read message from stdin
-		send(server, mes, strlen(mes), 0);	// send to server!
+	char mes[MAXCHAT];	// player's message
+	while (fgets(mes, MAXCHAT, stdin)) {	// always waits for input
+		proto_send(server, MSG_CHAT, mes, strlen(mes), 0);	// send to server!
 	}
+	return NULL;	// no more input
 }
 
 void* cl_read(void * value) {	// constant reading
-	char mes[MAXBUF];	// server's message
+	char *text;		// server's message
+	size_t len;		// message's length
+	int type;		// message type
 	while(1) {		// always waits for message from server
-		memset(mes, 0, MAXBUF);	// set bytes to 0
-		if (recv(server, mes, MAXBUF, 0) == 0) {
+		if (!proto_recv(server, &in, &type, &text, &len)) {
 			terminate();	// server crashes
 		}
-		printf("%s", mes);	// print server's message!
+		printf("%.*s", (int) len, text);	// print server's message!
 	}
 }
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE	// for accept4
 #include <stdio.h>	// standard input/output
 #include <stdlib.h>	// general purpose functions
 #include <string.h>	// string operations
@@ -7,55 +8,292 @@
 #include <sys/socket.h>	// socket definitions
 #include <sys/types.h>	// various type definitions
 #include <signal.h>	// for handling signals
+#include <sys/epoll.h>	// for the event loop
+#include <sys/resource.h>	// for the open files limit
+#include <fcntl.h>	// file control options
+#include <errno.h>	// for the errno variable
+#include <time.h>	// for clock_gettime
+#include <poll.h>	// for the poll function
+#include <sys/eventfd.h>	// wakes a player's thread
+#include <sys/inotify.h>	// watches the inventory file
+#include <sched.h>	// pins the reactors to cores
+#include <ctype.h>	// for toupper
+#include "../common/proto.h"	// framed messages
+#include "../common/catalog.h"	// resources of the game
+#include "../common/stats.h"	// counters of the stats socket
+#include "../common/prof.h"	// lock profiling
+#include "../common/net.h"	// TCP players
+#include "../common/router.h"	// backend of a router (-u)
+#include "../common/game.h"	// layout of a game's players
+#include "../common/zcopy.h"	// spliced chat (-z)
+#include "../common/history.h"	// chat history (-m, -l)
 
 #define PATH "server"	// server hostname
+#define STATS PATH STATS_SUFFIX	// stats socket
 #define MAX 16		// max size for small buffers
-#define MAXBUF 128	// max size for large buffers
 #define MAXLISTEN 50	// max queue length for listen
+#define MAXEVENTS 256	// max events per epoll_wait
+#define REMIND 5000	// ms between "Please wait..." messages
+#define CHUNK 1024	// games per chunk of the game table
+#define MAXCHUNKS (1 << 20)	// chunks in the game table
+#define HIWAT 65536	// default bytes queued for a player
+#define MAXIOV 64	// messages per vectored write
+#define MAXSHARDS 64	// max lobby shards
+#define MAXREACTORS 64	// max reactor threads
+#define CONNQ 4096	// connections queued for a reactor
+#define REPLAY (~0ul)	// a player came back, chat waits for the replay
 
-/* games are implemented using linked lists */
-/* "n" node of the list contains data for the "n" game */
+/* chat messages are framed once and shared by their recipients */
+typedef struct msg_t {	// framed message
+	int refs;	// queues holding it, the history, the log and the sender
+	unsigned long pos;	// its place in the game's history
+	struct msg_t *log;	// next one for the log (-l)
+	size_t len;	// frame's length
+	char frame[];	// framed message
+} msg_t;
+
+/* every player has an outbound queue, senders append to it and */
+/* write what the socket takes without blocking, the rest is */
+/* written by the player's thread (or the event loop) later */
+typedef struct outq_t {	// player's outbound queue
+	pthread_mutex_t lock;	// senders and flusher
+	int fd;		// player's file descriptor, 0 = none
+	int wake;	// eventfd of the player's thread, -1 = none
+	int armed;	// waiting for the socket to be writable
+	int kicked;	// disconnected for being too slow
+	msg_t **msgs;	// ring of queued messages
+	int head, count, size;	// first, used and allocated entries
+	size_t off;	// bytes of the first message already written
+	size_t bytes;	// bytes waiting
+	long dropped;	// messages over the high-water mark
+	unsigned long since;	// older history is not sent, REPLAY = none yet
+} __attribute__((aligned(CACHELINE))) outq_t;	// senders to two players never share a line
+
+/* games are kept in a table of chunks, game "n" is */
+/* entry (n-1) % CHUNK of chunk (n-1) / CHUNK */
+/* each game is a single block: where its slots are (see game.h) */
+/* and what admission and leaving touch, the history, the slots */
+/* of a small game, then the inventory */
 typedef struct game_t {	// everything for each game
-	int *inv;	// resources (inventory)
-	int *players;	// players' file descriptors
-	char **names;	// players' names
+	roster_t roster;	// players' file descriptors and names
+	outq_t *out;	// players' outbound queues
 	int active;	// active players in game
-	struct game_t *next;	// next game
+	struct shard_t *shard;	// shard that fills it
+	pthread_mutex_t *lock;	// and its lock
+	pthread_cond_t full;	// signaled when the game is full
+	int started;	// it filled up, its players may go on
+	int round;	// odd while the game is reset for reuse, even when ready
+	int next_free;	// next finished game, 0 = none
+	int reactor;	// reactor that serves its players (-r)
+	int settled;	// players that reached it, it alone writes it
+	/* the last chat messages, shared with the queues (-m, -l) */
+	pthread_mutex_t hist_lock;	// senders, returning players, the flusher
+	msg_t *hist[HISTORY];	// a ring, NULL = empty
+	unsigned long hist_head;	// next position to write
+	unsigned long hist_start;	// first position of this round
+	msg_t *log_first, *log_last;	// not logged yet, oldest first (-l)
+	struct {	// the slots of a game of up to MAXPLAYERS players
+		slots_t roster;	// descriptors and names
+		outq_t out[MAXPLAYERS];	// outbound queues
+	} small;
+	int inv[];	// resources (inventory), catalog.n
 } *game_t;
 
-game_t game;		// first game
-pthread_mutex_t mutex;	// mutex for inserting players
+/* players join through one of several lobby shards, every */
+/* shard fills its own game, so games fill in parallel */
+typedef struct shard_t {	// one lobby
+	pthread_mutex_t lock;	// inserts into the shard's games
+	int game_number;	// game being filled
+} shard_t;
+
+game_t **game_table;	// chunks of games, allocated when needed
+unsigned long free_games;	// finished games: a number, a tag above it
+shard_t shards[MAXSHARDS];	// lobby shards
+int nshards = 1;	// shards in use
+int next_shard;		// round robin among the shards
+pthread_condattr_t cond_attr;	// conditions use the monotonic clock
 int maxplayers;		// max players per game
 char inv_file[MAX];	// server inventory file
+catalog_t catalog;	// every resource, by id
+char *cat_file;		// catalog file, NULL = the six default resources
+int *inv_template;	// inventory file, parsed once for every game
+pthread_mutex_t template_lock = PTHREAD_MUTEX_INITIALIZER;	// reloads
 int quota;		// max resources per player
+size_t hiwat = HIWAT;	// max bytes queued for a player
+int kick_laggards;	// kick slow players instead of dropping messages
+int zero_copy;		// splice chat from a pipe instead of copying it (-z)
+__thread zcopy_t zc;	// this thread's pipes
+__thread int zc_state;	// 0 = not open yet, 1 = open, -1 = failed
+int history;		// messages replayed to a player who comes back (-m)
+char *history_path;	// chat log (-l), NULL = none
+seat_t seats[SEATS];	// where players who left sat, see history.h
+pthread_mutex_t seat_lock = PTHREAD_MUTEX_INITIALIZER;	// leaving and returning players
+hlog_t hlog;		// the chat log
+pthread_t flusher;	// writes it
+int stop_flushing;	// the server is closing
+stats_t stats;		// counters of the stats socket
+double stats_rate[STATS_RATES];	// their rates of the last second
+long started_ns;	// when the server started
+int stats_fd;		// stats socket
+char stats_path[108] = STATS;	// its name
+
+/* lock profiling (-P): every call site of a lock keeps its waits */
+/* and hold times, each thread in its own profile */
+enum { P_ADMIT, P_LEAVE, P_START, P_RELAY, P_DRAIN, P_SLOT, P_INVENTORY, P_HISTORY, P_SITES };
+const char *prof_site[P_SITES] = { "admit", "leave", "start", "relay", "drain", "slot", "inventory", "history" };
+typedef struct profile_t {	// a thread's profile
+	prof_t p;		// waits and hold times
+	long since[PROF_SITES];	// when the thread took each site's lock
+	int owned;		// a thread uses it
+	struct profile_t *next;	// every profile ever made
+} profile_t;
+int profiling;		// profile the locks
+profile_t *profiles;	// profiles, reused by new threads
+pthread_key_t prof_key;	// gives the profile back at thread exit
 
 int ret;		// for pthread_exit
 int server;		// server file descriptor
-int game_num;		// number of games
+int tcp_server = -1;	// TCP listening socket (-t), -1 = none
+char *tcp_addr;		// its [host:]port
+char *router_path;	// router's socket (-u), NULL = none
+int router = -1;	// link to the router, -1 = none
+int game_num;		// number of games (highest game number)
+
+/* event loop mode (-e): one thread serves every player */
+/* each connection is a small state machine instead of a thread */
+enum { CL_JOIN, CL_WAIT, CL_PLAY };	// connection states
+typedef struct conn_t {	// everything for each connection
+	int state;		// CL_JOIN, CL_WAIT or CL_PLAY
+	int game_number;	// player's game
+	char name[MAX];		// player's name
+	int slot;		// player's slot in the game
+	long deadline;		// next "Please wait..." (ms)
+	long accepted;		// when it was accepted (us)
+	int prev, next;		// waiting room list (fds, -1 = none)
+	frames_t in;		// player's messages, maybe partial
+} conn_t;
+
+int event_mode;		// run the event loop instead of threads
+__thread int epfd;		// epoll file descriptor
+__thread conn_t *conns;		// connections, indexed by file descriptor
+__thread int max_conns;		// size of conns
+__thread int wait_head = -1;	// first waiting player (oldest reminder)
+__thread int wait_tail = -1;	// last waiting player
+
+/* multi-reactor mode (-r): the main thread only accepts, it */
+/* passes each connection to one of N event loops, each one */
+/* pinned to a core, over a lock-free queue and wakes it with an */
+/* eventfd, every event loop has its own epoll, connections and */
+/* waiting room (the __thread variables above) */
+/* every game belongs to a reactor, a player admitted by another */
+/* one is passed on to it the same way, so all the players of a */
+/* game are served by one reactor and chat never crosses threads */
+typedef struct inbox_t {	// a connection on its way to a reactor
+	unsigned long seq;	// pos = free, pos+1 = filled, for turn pos
+	int fd;			// its descriptor
+	conn_t conn;		// its state, CL_JOIN if it is new
+} inbox_t;
 
-void terminate(int);		// signal handler for ctrl-c
+typedef struct reactor_t {	// one event loop thread
+	int id;			// its index
+	int wake;		// eventfd, connections were queued
+	int room;		// eventfd, connections were taken
+	int waiting;		// the acceptor sleeps on room
+	long load;		// connections it serves, for the acceptor
+	/* many producers (the acceptor, other reactors), one consumer */
+	unsigned long head __attribute__((aligned(CACHELINE)));	// next to take
+	unsigned long tail __attribute__((aligned(CACHELINE)));	// next to fill
+	inbox_t inbox[CONNQ];	// queued connections
+} reactor_t;
+
+reactor_t *reactors;	// event loops (-r), NULL = none
+int nreactors;		// how many
+int next_reactor;	// round robin among equals
+__thread reactor_t *my_reactor;	// this thread's, NULL = none
+
+void terminate(int);		// closes the server on ctrl-c
+void* wait_close(void *);	// takes ctrl-c for the whole server
 void destroy_everything(void);	// clear memory, close server
-void show_info(int);		// pretty info, handler for ctrl-z
+void show_info(int);		// stats and games, for the stats socket
+void* serve_stats(void *);	// answers the stats socket
+void report_load(void);		// tells the router our load
+long inventory_left(void);	// resources left in the games being filled
 void init_server(void);		// start server
+void init_games(void);		// catalog, inventory and first games
 game_t get_game(int);		// get current game
-void read_inventory(char *);	// read server's inventory file
-int resource_id(char *);	// hashing function for resources
+game_t new_game(int, shard_t *);	// allocate game "number"
+void place_slots(game_t);		// inline slots, or a block for a big game
+int claim_game(shard_t *);	// a finished game, or a new one
+void free_game(int);		// the game waits to be reused
+int *game_link(int);		// its next_free, for the free list
+int leave_game(int, int);	// player leaves, 1 if the game is over
+int read_inventory(char *, int *);	// read server's inventory file
+void copy_inventory(game_t);	// new game gets the inventory
+void* watch_inventory(void *);	// reloads the inventory file
 void* action(void *);		// does everything for the player
-int insert_player(int, char *);	// connect a player with the server
+int insert_player(int, char *, frames_t *);	// connect a player with the server
+int admit_player(int, char *, request_t *, int, int);	// add player to a game
+int rejoin_player(int, char *);	// a player takes the old seat back (-m)
+void lock_shard(shard_t *);	// locks a shard, the wait is counted
+void lock_at(pthread_mutex_t *, int);	// lock, profiled at a call site
+void unlock_at(pthread_mutex_t *, int);	// unlock, profiled at a call site
+int wait_at(pthread_cond_t *, pthread_mutex_t *, struct timespec *, int);	// timed condition wait
+profile_t *my_prof(void);	// this thread's profile
+void free_prof(void *);		// thread exit, the profile is reused
 void remove_player(int, int);	// kills player
+int player_slot(game_t, int);	// player's slot in the game
+
+void fanout(game_t, int, char *, size_t);	// queue a message for the others
+int queue_msg(outq_t *, msg_t *, int);	// queue a message for one player
+int push_msg(outq_t *, msg_t *, size_t);	// appends to a queue
+void queue_ctl(outq_t *, int, const char *, size_t);	// START or a reminder, event loops
+void arm_queue(outq_t *);	// the rest when the socket is writable
+int stage_msg(msg_t *);		// stages a message for splicing (-z)
+int flush_queue(outq_t *);	// write what the socket takes
+void drain_queue(outq_t *);	// flush a writable player
+void open_queue(outq_t *, int);	// a player takes the slot
+void close_queue(outq_t *);	// the player left
+void put_msg(msg_t *);		// done with a message
+void remember(game_t, msg_t *);	// keeps a message in the history
+void replay_history(game_t, int);	// the last ones, to a player who came back
+void* flush_history(void *);	// appends the histories to the log (-l)
+
+void event_loop(void);		// serves all players from one thread
+void serve_events(void);	// the event loop itself
+void start_reactors(void);	// starts the event loops of -r
+void* reactor_loop(void *);	// one of them
+reactor_t *pick_reactor(void);	// the one with the fewest connections
+int pass_conn(reactor_t *, int, conn_t *);	// queues a connection for a reactor
+void dispatch(int);		// the acceptor passes a connection on
+void take_conns(void);		// a reactor takes the queued ones
+void move_conn(int, reactor_t *);	// an admitted player goes to his game's reactor
+void accept_players(int);	// accepts every pending connection
+void route_players(void);	// takes players handed over by the router
+void open_conn(int);		// a new player's connection
+void adopt_conn(int, conn_t *);	// serves a connection from now on
+void settle_player(int);	// the player waits on his game's reactor
+void player_event(int);		// handles input of a connection
+void start_game(int);		// sends START to a full game
+void start_player(int);		// sends START to a waiting player
+void drop_player(int);		// closes a connection
+void wait_push(int);		// add player to the waiting room
+void wait_pop(int);		// remove player from the waiting room
+void remind_players(void);	// sends "Please wait..." when it is due
+long now_ms(void);		// monotonic clock in milliseconds
+long now_us(void);		// monotonic clock in microseconds
 
 // ./gameserver -p 5 -i inventory -q 5
 
 int main(int argc, char *argv[]) {
 	int new_fd;			// player's file descriptor
-	socklen_t addr_size;		// size of address
-	struct sockaddr_un cl_addr;	// Unix domain sockets
+	struct pollfd lfd[3];		// Unix and TCP listening sockets, router
 	pthread_t thr; // thread
+	int i;
 
 	/* checks if all arguments are OK */
-	if (argc != 7) {
+	if (argc < 7) {
 		printf("Run the server by writing:\n");
-		printf("./gameserver –p <num_of_players> -i <game_inventory> -q <quota_per_player>\n");
+		printf("./gameserver –p <num_of_players> -i <game_inventory> -q <quota_per_player> [-e] [-r <reactors>] [-o <max_queued_bytes>] [-k] [-z] [-s <shards>] [-c <catalog>] [-P] [-t <[host:]port>] [-u <router>] [-m <history>] [-l <chat_log>]\n");
 		exit(1);
 	}
 
@@ -80,334 +318,1874 @@ int main(int argc, char *argv[]) {
 		printf("Argument 5 must be -q\n"); exit(1);
 	}
 
+	for (i=7; i<argc; i++) {	// optional arguments
+		if (!strcmp(argv[i], "-e")) {
+			event_mode = 1;		// one thread, many players
+		}
+		else if (!strcmp(argv[i], "-r") && i+1 < argc) {
+			nreactors = atoi(argv[++i]);	// event loops, and an acceptor
+			if (nreactors < 1 || nreactors > MAXREACTORS) {
+				printf("Reactors must be between 1 and %d\n", MAXREACTORS); exit(1);
+			}
+			event_mode = 1;
+		}
+		else if (!strcmp(argv[i], "-o") && i+1 < argc) {
+			hiwat = atol(argv[++i]);	// high-water mark
+			if (hiwat < PROTO_HDR + MAXCHAT) {
+				printf("Max queued bytes must be at least %d\n", PROTO_HDR + MAXCHAT); exit(1);
+			}
+		}
+		else if (!strcmp(argv[i], "-k")) {
+			kick_laggards = 1;	// slow players are kicked
+		}
+		else if (!strcmp(argv[i], "-z")) {
+			zero_copy = 1;		// chat is spliced, not copied
+		}
+		else if (!strcmp(argv[i], "-s") && i+1 < argc) {
+			nshards = atoi(argv[++i]);	// games filled in parallel
+			if (nshards < 1 || nshards > MAXSHARDS) {
+				printf("Shards must be between 1 and %d\n", MAXSHARDS); exit(1);
+			}
+		}
+		else if (!strcmp(argv[i], "-c") && i+1 < argc) {
+			cat_file = argv[++i];	// resources of the game
+		}
+		else if (!strcmp(argv[i], "-P")) {
+			profiling = 1;		// lock waits and hold times
+		}
+		else if (!strcmp(argv[i], "-t") && i+1 < argc) {
+			tcp_addr = argv[++i];	// players over the network too
+		}
+		else if (!strcmp(argv[i], "-u") && i+1 < argc) {
+			router_path = argv[++i];	// players come from a router
+		}
+		else if (!strcmp(argv[i], "-m") && i+1 < argc) {
+			history = atoi(argv[++i]);	// players may come back
+			if (history < 1 || history > HISTORY) {
+				printf("History must be between 1 and %d\n", HISTORY); exit(1);
+			}
+		}
+		else if (!strcmp(argv[i], "-l") && i+1 < argc) {
+			history_path = argv[++i];	// chat is logged
+		}
+		else {
+			printf("Unknown argument %s\n", argv[i]); exit(1);
+		}
+	}
+	/* splice() blocks on a blocking socket, only the event loops */
+	/* make them non-blocking */
+	if (zero_copy && !event_mode) {
+		printf("-z needs -e or -r\n"); exit(1);
+	}
+
 	init_server();	// start server!
 	
 	printf("\n~~~~~ Server Started! ~~~~~\n");
-	printf("\n~~~ Press Ctrl-Z to view games and inventories! ~~~\n\n");
+	printf("\n~~~ Connect to %s to view games and stats! ~~~\n\n", stats_path);
+	if (router_path) {
+		printf("~~~ Players come from the router at %s ~~~\n\n", router_path);
+	}
+	if (tcp_addr) {
+		printf("~~~ Players may also connect to %s ~~~\n\n", tcp_addr);
+	}
 
-	addr_size = sizeof(struct sockaddr_un);
+	if (event_mode && !nreactors) {
+		event_loop();	// never returns
+	}
+
+	lfd[0].fd = server;		// poll skips the ones that are -1
+	lfd[1].fd = tcp_server;
+	lfd[2].fd = router;
+	lfd[0].events = lfd[1].events = lfd[2].events = POLLIN;
 	while (1) {
-		if ((new_fd = accept(server, (struct sockaddr *) &cl_addr, &addr_size)) == -1) {
-			perror("accept()\nerrno"); exit(1);	// debugging
+		if (poll(lfd, 3, -1) == -1) {
+			continue;	// interrupted by a signal
+		}
+		for (i=0; i<3; i++) {
+			if (!lfd[i].revents) {
+				continue;
+			}
+			if (lfd[i].fd == router) {	// handed over by the router
+				if ((new_fd = router_recv_fd(router)) == -1) {
+					if (errno == EAGAIN) continue;
+					printf("Router closed, no more players\n");
+					lfd[i].fd = -1;
+					continue;
+				}
+				stats_add(&stats.routed, 1);
+				if (nreactors) {
+					fcntl(new_fd, F_SETFL, fcntl(new_fd, F_GETFL) | O_NONBLOCK);
+				}
+			}
+			else if ((new_fd = accept4(lfd[i].fd, NULL, NULL, nreactors ? SOCK_NONBLOCK : 0)) == -1) {
+				perror("accept()\nerrno"); exit(1);	// debugging
+			}
+			if (lfd[i].fd == tcp_server) {
+				tcp_nodelay(new_fd);	// chat leaves at once
+			}
+			if (nreactors) {
+				dispatch(new_fd);	// a reactor serves him
+				continue;
+			}
+			/* after accepting a player, create a thread calling action */
+			/* action takes player's file descriptor and does everything */
+			/* the descriptor is passed by value, the next accept */
+			/* overwrites new_fd before the thread may have read it */
+			pthread_create(&thr, NULL, action, (void *) (long) new_fd);
+			pthread_detach(thr);	// don't wait for thread
 		}
-		/* after accepting a player, create a thread calling action */
-		/* action takes player's file descriptor and does everything */
-		pthread_create(&thr, NULL, action, &new_fd);
-		pthread_detach(thr);	// don't wait for thread
 	}
 	return 0;	// unreachable
 }
 
 void destroy_everything() {	// free memory
-	game_t g = game;	// get first game
-	game_t temp;		// used to get next game
+	game_t g;
 	int i, j;
 
 	for (i=0; i<game_num; i++) { 	// for each game
+		if (!(g = get_game(i+1))) {
+			continue;	// still being created
+		}
 		for (j=0; j<maxplayers; j++) {
-			if (g->names[j]) {
-				free(g->names[j]);	// free names
+			close_queue(&g->out[j]);	// free queued messages
+			free(g->out[j].msgs);
+			pthread_mutex_destroy(&g->out[j].lock);
+		}
+		for (j=0; j<HISTORY; j++) {
+			if (g->hist[j]) {
+				put_msg(g->hist[j]);	// free the history
 			}
 		}
-		free(g->names);		// free array of names
-		free(g->inv);		// free inventory
-		free(g->players);	// free array of players' file descriptors
-		temp = g;		// temporary
-		g = g->next;		// get next game
-		free(temp);		// free game
+		pthread_mutex_destroy(&g->hist_lock);
+		/* the start barrier is left alone, players of a game that */
+		/* never filled still wait on it and destroying it would */
+		/* wait for them, exit takes them along */
+		if (maxplayers > MAXPLAYERS) {
+			free(g->roster.fd);	// a big game's slots, the block starts there
+		}
+		free(g);		// free game
+	}
+	for (i=0; i<(game_num + CHUNK - 1) / CHUNK; i++) {
+		free(game_table[i]);	// free chunk
+	}
+	free(game_table);		// free table
+	free(inv_template);		// free inventory file
+	catalog_free(&catalog);		// free resources
+	if (!router_path) {
+		remove(PATH);		// remove server file
+	}
+	remove(stats_path);		// and stats file
+	for (i=0; i<nshards; i++) {
+		pthread_mutex_destroy(&shards[i].lock);	// destroy mutexes
 	}
-	remove(PATH);			// remove server file
-	pthread_mutex_destroy(&mutex);	// destroy mutex
 }
 
 
+/* runs in wait_close's thread, never in a handler, so it may */
+/* wait for the flusher and take any lock */
 void terminate(int signo) {		// close server!
 	printf("\n~~~~~ Server Closing! ~~~~~\n\n");
+	if (history_path) {	// the flusher's last pass, before the games go
+		__atomic_store_n(&stop_flushing, 1, __ATOMIC_RELEASE);
+		pthread_join(flusher, NULL);
+	}
 	destroy_everything();	// destroy everything!
 
 	exit(0);	// terminate server!
 }
 
-void show_info(int signo) {	// pretty function
+/* the only thread that takes SIGINT, the others block it */
+void* wait_close(void *arg) {
+	sigset_t ctrl_c;
+	int signo;
+
+	sigemptyset(&ctrl_c);
+	sigaddset(&ctrl_c, SIGINT);
+	while (sigwait(&ctrl_c, &signo) != 0);
+	terminate(signo);
+	return NULL;	// unreachable
+}
+
+/* counters, rates and latencies, then the games being filled */
+/* and what is left of their inventories, nothing is locked so */
+/* the numbers of a busy server may be a little off */
+void show_info(int fd) {
 	game_t g;
-	int i, j;
-	int empty;
+	profile_t *p;		// threads' profiles
+	prof_t **all;
+	int i, j, n = 0;
 
-	g = game;	// get first game
-	for (i=0, g=game; i<game_num; i++, g=g->next) {
-		printf("\n~~~~~ GAME %d ~~~~~ \n", i+1);
-		printf("\nOnline players :\n");
-		empty = 1;			// flag for empty game
+	stats_print(fd, &stats, stats_rate, started_ns);
+	for (i=0; i<nreactors; i++) {
+		dprintf(fd, "reactor %d connections %ld\n", i,
+			__atomic_load_n(&reactors[i].load, __ATOMIC_RELAXED));
+	}
+	if (profiling) {	// every thread's profile, summed
+		for (p = __atomic_load_n(&profiles, __ATOMIC_ACQUIRE); p; p = p->next, n++);
+		if ((all = malloc((n + 1) * sizeof(prof_t *)))) {
+			for (p = profiles, i = 0; p && i < n; p = p->next) {
+				all[i++] = &p->p;
+			}
+			prof_print(fd, prof_site, P_SITES, all, i);
+			free(all);
+		}
+	}
+	for (i=0; i<nshards; i++) {
+		if (!(g = get_game(__atomic_load_n(&shards[i].game_number, __ATOMIC_ACQUIRE)))) {
+			continue;	// still being created
+		}
+		dprintf(fd, "game %d shard %d players %d\n", shards[i].game_number, i, g->active);
 		for (j=0; j<maxplayers; j++) {
-			if (g->players[j]) {
-				empty = 0;	// game is not empty
-				printf("%s\n", g->names[j]);
+			if (g->roster.fd[j]) {
+				dprintf(fd, "game %d player %s dropped %ld\n", shards[i].game_number,
+					g->roster.name[j], g->out[j].dropped);
 			}
 		}
-		if (empty) {			// game is empty..
-			printf("No online players..\n");
+		for (j=0; j<catalog.n; j++) {	// inventory for each game
+			dprintf(fd, "game %d %s %d\n", shards[i].game_number,
+				catalog.name[j], g->inv[j]);
 		}
-		/* inventory for each game */
-		printf("\nInventory [ %d ] :\n", i+1);
-		printf("Gold : %d\n", g->inv[0]);
-		printf("Armor : %d\n", g->inv[1]);
-		printf("Ammo : %d\n", g->inv[2]);
-		printf("Lumber : %d\n", g->inv[3]);
-		printf("Magic : %d\n", g->inv[4]);
-		printf("Rock : %d\n", g->inv[5]);
-	}	// get next game
-	printf("\n~~~ That's all! ~~~\n\n");
+	}
+}
+
+/* the stats thread, one report per connection, the rates are */
+/* worked out every second in between */
+void* serve_stats(void *arg) {
+	struct pollfd p = { stats_fd, POLLIN, 0 };	// stats socket
+	long last[STATS_RATES], last_ns = 0;	// previous tick
+	long last_report = 0;	// previous load report (-u)
+	int fd;
+
+	while (1) {
+		if (stats_ns() - last_ns >= 1000000000L) {
+			stats_tick(&stats, last, &last_ns, stats_rate);
+		}
+		if (router != -1 && stats_ns() - last_report >= REPORT * 1000000L) {
+			report_load();
+			last_report = stats_ns();
+		}
+		if (poll(&p, 1, router != -1 ? REPORT : 1000) != 1) {
+			continue;	// time for a tick
+		}
+		if ((fd = accept(stats_fd, NULL, NULL)) == -1) {
+			continue;
+		}
+		show_info(fd);
+		close(fd);
+	}
+	return NULL;
+}
+
+/* the router picks a backend by these, the first report also */
+/* tells it who we are */
+void report_load() {
+	load_t load;
+
+	load.pid = getpid();
+	load.routed = stats.routed;
+	load.games = stats.games;
+	load.players = stats.players;
+	load.inventory = inventory_left();
+	router_report(router, &load);
+}
+
+/* nothing is locked, the router only needs a rough figure */
+long inventory_left() {
+	game_t g;
+	long left = 0;
+	int i, j;
+
+	for (i=0; i<nshards; i++) {
+		if (!(g = get_game(__atomic_load_n(&shards[i].game_number, __ATOMIC_ACQUIRE)))) {
+			continue;	// still being created
+		}
+		for (j=0; j<catalog.n; j++) {
+			left += __atomic_load_n(&g->inv[j], __ATOMIC_RELAXED);
+		}
+	}
+	return left;
 }
 
 
 void init_server() {
 	struct sockaddr_un srv_addr;	// Unix domain sockets
+	sigset_t ctrl_c;	// SIGINT, for wait_close only
+	pthread_t thr;		// inventory watcher, closer
 
-	pthread_mutex_init(&mutex, 0);	// initialize mutex
-	if ( signal(SIGINT, terminate) == SIG_ERR ) {
-		perror("signal()\nerrno"); exit(1);	// debugging
+	/* blocked before any thread starts, they all inherit it */
+	sigemptyset(&ctrl_c);
+	sigaddset(&ctrl_c, SIGINT);
+	if (pthread_sigmask(SIG_BLOCK, &ctrl_c, NULL) != 0) {
+		perror("pthread_sigmask()\nerrno"); exit(1);	// debugging
 	}
-	if ( signal(SIGTSTP, show_info) == SIG_ERR ) {
-		perror("signal()\nerrno"); exit(1);	// debugging
+	pthread_create(&thr, NULL, wait_close, NULL);
+	pthread_detach(thr);	// lives as long as the server
+	signal(SIGPIPE, SIG_IGN);	// players may leave while we send
+	started_ns = stats_ns();
+	pthread_key_create(&prof_key, free_prof);	// for -P
+
+	if (nreactors) {
+		start_reactors();	// games are handed out to them
 	}
+	init_games();		// every shard gets its first game
+	pthread_create(&thr, NULL, watch_inventory, NULL);
+	pthread_detach(thr);	// lives as long as the server
 
-	/* set initial values to game */
-	/* dynamic memory allocation for games (nodes of linked list) */
-	game = (game_t) malloc(sizeof(*game));
-	/* set inventory resources to 0 */
-	game->inv = (int *) calloc (6, sizeof(int));
-	/* set players' file descriptors to 0 */
-	game->players = (int *) calloc (maxplayers, sizeof(int));	
-	/* set array of players' names to NULL */
-	game->names = (char **) calloc(maxplayers, sizeof(char));
-	game->next = NULL;	// no next game
-	game->active = 0;	// no active players
-	game_num = 1;	// first game
+	/* chat is logged off the players' threads */
+	if (history_path) {
+		if (hlog_open(&hlog, history_path) == -1) {
+			perror("hlog_open()\nerrno"); exit(1);	// debugging
+		}
+		pthread_create(&flusher, NULL, flush_history, NULL);
+	}
 
-	read_inventory(inv_file);	// read inventory file
+	/* a backend (-u) has no socket of its own for the players, */
+	/* it shares the router's directory with the other backends */
+	if (router_path) {
+		if ((router = router_link(router_path)) == -1) {
+			perror("router_link()\nerrno"); exit(1);	// debugging
+		}
+		snprintf(stats_path, sizeof(stats_path), "%s.%d%s", PATH, getpid(), STATS_SUFFIX);
+	}
 
-	/****** start server ******/
+	/****** stats socket, next to the server's ******/
 	memset(&srv_addr, 0, sizeof(struct sockaddr_un));
 	srv_addr.sun_family = AF_UNIX;
-	strncpy(srv_addr.sun_path, PATH,
-			sizeof(srv_addr.sun_path) - 1);	// server hostname
+	snprintf(srv_addr.sun_path, sizeof(srv_addr.sun_path), "%s", stats_path);
 
-	if ((server = socket(AF_UNIX, SOCK_STREAM, 0)) == -1) {
+	if ((stats_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) == -1) {
 		perror("socket()\nerrno"); exit(1);	// debugging
 	}
+	remove(stats_path);	// remove stats file if already exists
+	if (bind(stats_fd, (struct sockaddr *) &srv_addr, sizeof(struct sockaddr_un)) == -1 ||
+			listen(stats_fd, MAXLISTEN) == -1) {
+		perror("bind()\nerrno"); exit(1);		// debugging
+	}
+	pthread_create(&thr, NULL, serve_stats, NULL);
+	pthread_detach(thr);	// lives as long as the server
 
-	remove(PATH);	// remove server file if already exists
-	if (bind(server, (struct sockaddr *) &srv_addr,
-            sizeof(struct sockaddr_un)) == -1) {
-        perror("bind()\nerrno"); exit(1);		// debugging
+	if (router_path) {
+		server = -1;	// the router's socket is enough
 	}
+	else {
+		/****** start server ******/
+		memset(&srv_addr, 0, sizeof(struct sockaddr_un));
+		srv_addr.sun_family = AF_UNIX;
+		strncpy(srv_addr.sun_path, PATH,
+				sizeof(srv_addr.sun_path) - 1);	// server hostname
+
+		if ((server = socket(AF_UNIX, SOCK_STREAM, 0)) == -1) {
+			perror("socket()\nerrno"); exit(1);	// debugging
+		}
+
+		remove(PATH);	// remove server file if already exists
+		if (bind(server, (struct sockaddr *) &srv_addr,
+				sizeof(struct sockaddr_un)) == -1) {
+			perror("bind()\nerrno"); exit(1);	// debugging
+		}
 
-	if (listen(server, MAXLISTEN) == -1) {
-		perror("listen()\nerrno"); exit(1);	// debugging
+		/* the event loop expects connection storms */
+		if (listen(server, event_mode ? SOMAXCONN : MAXLISTEN) == -1) {
+			perror("listen()\nerrno"); exit(1);	// debugging
+		}
+	}
+
+	/* players on other machines (-t), same protocol */
+	if (tcp_addr && (tcp_server = tcp_listen(tcp_addr, event_mode ? SOMAXCONN : MAXLISTEN)) == -1) {
+		perror("tcp_listen()\nerrno"); exit(1);	// debugging
+	}
+}
+
+/* no sockets or threads here, so the benchmarks can call it */
+void init_games() {
+	int i;
+
+	pthread_condattr_init(&cond_attr);
+	pthread_condattr_setclock(&cond_attr, CLOCK_MONOTONIC);	// for timeouts
+
+	/* only the pages of the table that are used take memory */
+	if (!(game_table = (game_t **) calloc(MAXCHUNKS, sizeof(game_t *)))) {
+		perror("calloc()\nerrno"); exit(1);	// debugging
+	}
+	/* resources are numbered once, by the catalog */
+	if (catalog_load(&catalog, cat_file) == -1) {
+		printf("Could not load the catalog %s\n", cat_file); exit(1);
+	}
+	if (!(inv_template = (int *) calloc(catalog.n, sizeof(int)))) {
+		perror("calloc()\nerrno"); exit(1);	// debugging
+	}
+	/* the file is parsed once, games copy it */
+	if (read_inventory(inv_file, inv_template) == -1) {
+		exit(1);
+	}
+
+	for (i=0; i<nshards; i++) {	// every shard fills its first game
+		pthread_mutex_init(&shards[i].lock, 0);	// initialize mutex
+		shards[i].game_number = i+1;
+		copy_inventory(new_game(i+1, &shards[i]));	// set inventory
 	}
+	game_num = nshards;
 }
 
-/* returns node "number" of the linked list */
+/* returns game "number" of the table */
+/* NULL while the game is being created */
 game_t get_game(int number) {
+	game_t *chunk = __atomic_load_n(&game_table[(number-1) / CHUNK], __ATOMIC_ACQUIRE);
+
+	return chunk ? __atomic_load_n(&chunk[(number-1) % CHUNK], __ATOMIC_ACQUIRE) : NULL;
+}
+
+/* creates game "number", called with the shard's mutex locked */
+/* shards may create games of the same chunk at the same time */
+game_t new_game(int number, shard_t *shard) {
+	game_t g;		// new game
+	game_t *chunk, *mine;	// its chunk
 	int i;
-	game_t current_game = game;	// current game, return value
-	for (i=0; i<number-1; i++) {
-		current_game = current_game->next;	// get next game
+
+	if (number > MAXCHUNKS * CHUNK) {
+		printf("Too many games\n"); exit(1);
+	}
+	if (!(chunk = __atomic_load_n(&game_table[(number-1) / CHUNK], __ATOMIC_ACQUIRE))) {
+		if (!(mine = (game_t *) calloc(CHUNK, sizeof(game_t)))) {
+			perror("calloc()\nerrno"); exit(1);	// debugging
+		}
+		if (__atomic_compare_exchange_n(&game_table[(number-1) / CHUNK], &chunk,
+				mine, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+			chunk = mine;
+		}
+		else {
+			free(mine);	// another shard was first
+		}
+	}
+
+	/* set initial values to game, one block on its own cache */
+	/* lines, no slots, names or resources yet */
+	if (!(g = (game_t) aligned_alloc(CACHELINE, GAME_SIZE(struct game_t, catalog.n)))) {
+		perror("aligned_alloc()\nerrno"); exit(1);	// debugging
+	}
+	memset(g, 0, GAME_SIZE(struct game_t, catalog.n));
+	place_slots(g);
+	/* outbound queues stay with the slots, players come and go */
+	for (i=0; i<maxplayers; i++) {
+		pthread_mutex_init(&g->out[i].lock, 0);
+		g->out[i].wake = -1;	// no thread yet
+	}
+	pthread_mutex_init(&g->hist_lock, 0);	// no history yet
+	g->active = 0;	// no active players
+	g->shard = shard;	// the shard that fills it
+	g->lock = &shard->lock;
+	g->round = g->next_free = 0;
+	g->reactor = nreactors ? pick_reactor()->id : 0;
+	pthread_cond_init(&g->full, &cond_attr);	// start barrier
+	__atomic_store_n(&chunk[(number-1) % CHUNK], g, __ATOMIC_RELEASE);
+
+	return g;
+}
+
+/* points a new game to its slots: inline, or in a block of */
+/* their own if it has more than MAXPLAYERS (see game.h) */
+void place_slots(game_t g) {
+	size_t size = ROSTER_BYTES(maxplayers) + SLOTS_BYTES(maxplayers, sizeof(outq_t));
+	char *block = NULL;	// a big game's slots
+
+	if (maxplayers > MAXPLAYERS) {
+		if (!(block = aligned_alloc(CACHELINE, size))) {
+			perror("aligned_alloc()\nerrno"); exit(1);	// debugging
+		}
+		memset(block, 0, size);
+	}
+	roster_place(&g->roster, &g->small.roster, &block, maxplayers);
+	g->out = maxplayers <= MAXPLAYERS ? g->small.out :
+		(outq_t *) slots_carve(&block, maxplayers, sizeof(outq_t));
+}
+
+/* the shard's next game, called with the shard's mutex locked */
+/* finished games are reused before a new one is allocated, so */
+/* once a server has seen its busiest hour it allocates no more */
+/* the free list is game_pop's stack, see game.h */
+int claim_game(shard_t *shard) {
+	game_t g;
+	int n;
+
+	if (!(n = game_pop(&free_games, game_link))) {	// none finished, a new one
+		n = __atomic_add_fetch(&game_num, 1, __ATOMIC_ACQ_REL);
+		copy_inventory(new_game(n, shard));
+		return n;
 	}
-	return current_game;	// return "number" game
+
+	/* its players are gone and its queues are closed, only */
+	/* the inventory is left over */
+	g = get_game(n);
+	g->shard = shard;
+	g->lock = &shard->lock;
+	g->reactor = nreactors ? pick_reactor()->id : 0;
+	/* the old messages are only left for the log */
+	__atomic_store_n(&g->hist_start, __atomic_load_n(&g->hist_head, __ATOMIC_ACQUIRE), __ATOMIC_RELAXED);
+	g->started = 0;
+	/* the round is odd while the inventory is copied, even once */
+	/* it is whole, late players that took from the old one see it */
+	/* change and leave the new one alone, see admit_player */
+	__atomic_add_fetch(&g->round, 1, __ATOMIC_SEQ_CST);	// odd, being copied
+	copy_inventory(g);
+	__atomic_add_fetch(&g->round, 1, __ATOMIC_SEQ_CST);	// even, ready
+	return n;
+}
+
+/* where game n links to the next finished one */
+int *game_link(int n) {
+	return &get_game(n)->next_free;
+}
+
+void free_game(int number) {
+	game_push(&free_games, game_link(number), number);
 }
 
-void read_inventory(char * fname) {
+/* removes the player, the last one of a started game gives it */
+/* back to be reused, returns 1 if the game is over */
+/* with -m a player who leaves a running game may come back */
+int leave_game(int cl, int game_number) {
+	game_t g = get_game(game_number);	// player's game
+	shard_t *shard = g->shard;	// g may be reused once we give it back
+	int over = 0, i;
+
+	lock_at(&shard->lock, P_LEAVE);	// the slot becomes free
+	i = player_slot(g, cl);
+	if (history && i < maxplayers && shard->game_number != game_number && g->active > 1) {
+		lock_at(&seat_lock, P_HISTORY);
+		history_keep(seats, g->roster.name[i],
+				(unsigned long) (unsigned) g->round << 32 | game_number, stats_ns());
+		unlock_at(&seat_lock, P_HISTORY);
+	}
+	remove_player(cl, game_number);	// kill player
+	if (--g->active == 0) {		// decrease active players of game
+		stats_add(&stats.games, -1);
+		/* the shard's own game is still being filled */
+		if ((over = shard->game_number != game_number)) {
+			free_game(game_number);
+		}
+	}
+	stats_add(&stats.players, -1);
+	unlock_at(&shard->lock, P_LEAVE);
+	return over;
+}
+
+/* parses an inventory file, returns -1 if it is wrong */
+int read_inventory(char * fname, int *inv) {
 	FILE *fp;
 	int i, num;
-	char word[MAX];		// holds each line
+	int *parsed;		// missing resources are 0
+	char word[RESNAME];	// holds each line
 
 	if ((fp = fopen(fname, "r")) == NULL) {
-		perror("File does not exist\nerrno"); exit(1);	// debugging
+		perror("File does not exist\nerrno");	// debugging
+		return -1;
+	}
+	if (!(parsed = (int *) calloc(catalog.n, sizeof(int)))) {
+		perror("calloc()\nerrno"); exit(1);	// debugging
 	}
-	fseek(fp, 0, SEEK_END);	// set position indicator to EOF
-	rewind(fp);		// set position indicator to beginning
 
-	while( fscanf(fp, "%s\t%d\n", word, &num) != EOF ) {
-		i = resource_id(word);	// hashing function
+	while( fscanf(fp, "%15s\t%d\n", word, &num) == 2 ) {
+		i = catalog_id(&catalog, word);	// hashed lookup
 
 		if (i == -1) {	// item does not exist
-			perror("Wrong inventory\nerrno"); exit(1);
+			printf("Wrong inventory, unknown resource %s\n", word);
+			fclose(fp);
+			free(parsed);
+			return -1;
 		}
-		get_game(game_num)->inv[i] = num;	// set inventory values
+		parsed[i] = num;	// set inventory values
 	}
 	fclose(fp);		// close file
+
+	lock_at(&template_lock, P_INVENTORY);
+	memcpy(inv, parsed, catalog.n * sizeof(int));
+	unlock_at(&template_lock, P_INVENTORY);
+	free(parsed);
+	return 0;
+}
+
+/* new games copy the template, no disk I/O in the admission */
+void copy_inventory(game_t g) {
+	lock_at(&template_lock, P_INVENTORY);
+	memcpy(g->inv, inv_template, catalog.n * sizeof(int));
+	unlock_at(&template_lock, P_INVENTORY);
 }
 
-int resource_id(char * res) {	// hashing function
-	return (!strcmp(res, "gold") ? 0 :
-			!strcmp(res, "armor") ? 1 :
-			!strcmp(res, "ammo") ? 2 :
-			!strcmp(res, "lumber") ? 3 :
-			!strcmp(res, "magic") ? 4 :
-			!strcmp(res, "rock") ? 5 : -1);
+/* watches the inventory file's directory, editors often replace */
+/* the file instead of writing it, the next game gets the changes */
+void* watch_inventory(void *arg) {
+	char buf[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+	struct inotify_event *ev;	// one change
+	char dir[MAX], *name;	// inventory file's directory and name
+	ssize_t n;
+	int fd;
+
+	strcpy(dir, inv_file);
+	if ((name = strrchr(dir, '/'))) {
+		*name++ = 0;	// dir/name
+		name = inv_file + (name - dir);
+	}
+	else {
+		strcpy(dir, ".");
+		name = inv_file;
+	}
+
+	if ((fd = inotify_init1(IN_CLOEXEC)) == -1 ||
+			inotify_add_watch(fd, dir, IN_CLOSE_WRITE | IN_MOVED_TO) == -1) {
+		perror("inotify()\nerrno");	// debugging
+		return NULL;		// no reloads, the server goes on
+	}
+
+	while ((n = read(fd, buf, sizeof(buf))) > 0 || (n == -1 && errno == EINTR)) {
+		for (ev = (struct inotify_event *) buf; (char *) ev < buf + n;
+				ev = (struct inotify_event *) ((char *) ev + sizeof(*ev) + ev->len)) {
+			if (ev->len && !strcmp(ev->name, name)) {
+				if (read_inventory(inv_file, inv_template) == 0) {
+					printf("Inventory reloaded, next games get it\n");
+				}
+				else {
+					printf("Inventory not reloaded, keeping the old one\n");
+				}
+			}
+		}
+	}
+	close(fd);
+	return NULL;
 }
+
 /* this is the game */
 void* action(void *fd) {
-	int cl = *(int *)fd;	// player's file descriptor
+	int cl = (long) fd;	// player's file descriptor
 	int game_number;	// current game number
-	int i;
-	int timer = 0;		// for the 5 seconds timer
-	char buf[MAXBUF], message[MAXBUF];	// buffers
+	int slot, n;		// player's slot, bytes read
+	int over;		// we were the last player
+	struct timespec remind;	// next "Please wait..."
+	struct pollfd pfd[2];	// player and wake up
+	eventfd_t wakes;	// wake ups
+	outq_t *q;		// player's outbound queue
+	char frame[PROTO_HDR + MAXCHAT + 1];	// message for the others
+	size_t len;		// frame's length
+	frames_t in = {0};	// player's messages
+	char *text;		// player's message
+	int type;		// message type
 	char name[MAX];		// player's name
 	game_t g;		// current game struct
+	long accepted = now_us();	// for the latency stats
 
 	memset(name, 0, MAX);		// set buffer to \0
 	/* try to insert player to server */
 	/* if successful, return player's game number and name */
-	game_number = insert_player(cl, name);
+	game_number = insert_player(cl, name, &in);
+	histo_add(&stats.admission, now_us() - accepted);	// accept-to-OK latency
 
 	g = get_game(game_number);	// get current game
+	slot = player_slot(g, cl);	// player's slot
+	q = &g->out[slot];
 
-	while(g->active < maxplayers) {	// till game is full
-		usleep(100000);		// every 0.1 sec checks
-		timer += 1;		// till it reaches 5 seconds
-		if (timer == 50) {	// 5 seconds
-			timer = 0;	// reset timer
-			send(cl, "Please wait...\n",16,0);	// waiting..
+	/* others wake us up when our socket is full */
+	lock_at(&q->lock, P_SLOT);
+	if ((q->wake = eventfd(0, EFD_NONBLOCK)) == -1) {
+		perror("eventfd()\nerrno"); exit(1);	// debugging
+	}
+	unlock_at(&q->lock, P_SLOT);
+
+	/* sleep till the last player is inserted */
+	/* or till it is time for a reminder */
+	clock_gettime(CLOCK_MONOTONIC, &remind);
+	remind.tv_sec += REMIND / 1000;
+	lock_at(g->lock, P_START);
+	/* a player who came back does not wait */
+	/* players may leave once woken, so the game being full is */
+	/* remembered, a count of players would lose the wake up */
+	while(q->since != REPLAY && !g->started) {	// till game is full
+		if (wait_at(&g->full, g->lock, &remind, P_START) == ETIMEDOUT) {
+			unlock_at(g->lock, P_START);	// do not block inserts
+			proto_send(cl, MSG_WAIT, "Please wait...\n", 15, 0);	// waiting..
+			remind.tv_sec += REMIND / 1000;	// 5 more seconds
+			lock_at(g->lock, P_START);
 		}
 	}
-	usleep(100000);			// solves some bugs..
-	send(cl, "START\n", 7, 0);	// send start message to players
+	unlock_at(g->lock, P_START);
+	proto_send(cl, MSG_START, "START\n", 6, 0);	// send start message to players
 	printf("%s is ready!\n", name);	// players are ready!
+	if (q->since == REPLAY) {
+		replay_history(g, slot);	// what was said meanwhile
+	}
+
+	pfd[0].fd = cl;		// player's messages
+	pfd[1].fd = q->wake;	// our queue needs us
+	pfd[1].events = POLLIN;
 
 	while (1) {	// chatting
-		memset(message, 0, MAXBUF);	// set message to \0
-		/* customize the message, so it shows who sent it */
-		strncat(message, name, strlen(name));
-		strncat(message, " : ", 4);
-
-		memset(buf, 0, MAXBUF);				// set buffer to 0
-		if(!recv(cl, buf, MAXBUF, 0)) {			// player crashed
-			remove_player(cl, game_number);		// kill player
+		/* wait for writable only while the queue is stuck */
+		pfd[0].events = POLLIN;
+		if (__atomic_load_n(&q->armed, __ATOMIC_ACQUIRE)) {
+			pfd[0].events |= POLLOUT;
+		}
+		if (poll(pfd, 2, -1) == -1) {
+			continue;	// interrupted by a signal
+		}
+		if (pfd[1].revents & POLLIN) {
+			eventfd_read(pfd[1].fd, &wakes);	// armed is checked again
+		}
+		if (pfd[0].revents & POLLOUT) {
+			drain_queue(q);		// room for queued messages
+		}
+		if (!(pfd[0].revents & (POLLIN | POLLHUP | POLLERR))) {
+			continue;	// player said nothing
+		}
+
+		n = proto_read(cl, &in);
+		if (n == -1 && errno == EINTR) {
+			continue;
+		}
+		if (n <= 0) {		// player crashed
+			proto_free(&in);
+			close_queue(q);		// nobody writes to him anymore
+			over = leave_game(cl, game_number);	// g is not ours anymore
+			close(pfd[1].fd);
+			close(cl);
 			printf("Player %s left..\n", name);	// inform the others
-			g->active--;			// decrease active players of game
-			if(g->active == 0) {	// empty game
+			if (over) {	// empty game
 				printf("All players left.\nGame Over\n\n");
 			}
 			pthread_exit(&ret);	// terminate player's thread
 		}
 
-		strncat(message, buf, strlen(buf));	// for pretty code
-
-		/* threads share everything, including open file descriptors */
-		/* so any player can send a message to another player */
-		for (i=0; i<maxplayers; i++) {
-			/* sends the message to all other players of the same game */
-			if (g->players[i] != 0 && g->players[i] != cl) {
-				send(g->players[i], message, MAXBUF, 0);
+		/* one read may hold many messages, or only part of one */
+		while (proto_next(&in, &type, &text, &len)) {
+			if (type != MSG_CHAT) {
+				continue;	// players only chat now
 			}
+			/* customize the message, so it shows who sent it */
+			len = proto_printf(frame, MAXCHAT, MSG_CHAT, "%s : %.*s",
+					name, (int) len, text);
+			fanout(g, slot, frame, len);
 		}
 	}
 }
 
-int insert_player(int cl, char *name) {
-	int i;
-	int ok=1, num, temp[6] = {0}, sum = 0;	// various flags and variables
-	char res[MAX], buf[MAXBUF], *line;	// buffers
-	game_t g;		// player's game
+int insert_player(int cl, char *name, frames_t *in) {
+	int ok, sum = 0;	// various flags and variables
+	request_t req;		// player's resources
+	char *request;		// player's request
+	size_t len;		// request's length
+	int type;		// message type
 	int game_number;	// game's number
 
-	memset(buf, 0, MAXBUF);	// set buf to \0
-
-	if (recv(cl, buf, MAXBUF, 0) == 0) {	// player crashes
+	if (!proto_recv(cl, in, &type, &request, &len)) {	// player crashes
 		printf("Could not add player..\n");
+		proto_free(in);
 		pthread_exit(&ret);	// terminate player's thread
 	}
 
-	line = strtok (buf,"\n");		// get player's name
-	if (sscanf(line, "%s", name) != 1) {	// no name in first line
-		ok = 0;		// flag, player is not ok
-	}
-	else {
-		line = strtok (NULL, "\n");	// next line
+	ok = type == MSG_JOIN &&
+		catalog_parse(&catalog, quota, request, len, name, MAX, &req, &sum);	// read request
+
+	if (!(game_number = admit_player(cl, name, &req, sum, ok))) {
+		proto_free(in);
+		pthread_exit(&ret);		// terminate player's thread
 	}
 
-	while (line && ok) {	// till it reaches EOF or player is not ok
-		if ((sscanf(line, "%s\t%d", res, &num)) == 1) {
-			ok = 0;			// bad file
-		}
-		else {				// good file
-			if (((i = resource_id(res)) < 0) || (num <= 0)) {
-				ok = 0;		// invalid resource or invalid number
-			}
-			else {
-				temp[i] += num;	// player's request
-				sum += num;	// total resources
-			}
+	return game_number;		// return player's game number
+}
 
-			line = strtok (NULL, "\n");	// next line
-		}
-	}	// EOF
+/* inserts an approved player to the current game */
+/* returns player's game number, or 0 if the server disapproves */
+int admit_player(int cl, char *name, request_t *req, int sum, int ok) {
+	int i;
+	game_t g;		// player's game
+	int game_number;	// game's number
+	int round;		// and its round
+	shard_t *shard;		// player's lobby
+
+	if( sum > quota ) {	// checks if player is too greedy
+		ok = 0;
+	}
+	if (ok && history && (game_number = rejoin_player(cl, name))) {
+		return game_number;	// back to a running game
+	}
 
-	pthread_mutex_lock(&mutex);	// one insert at a time
+	shard = &shards[__atomic_fetch_add(&next_shard, 1, __ATOMIC_RELAXED) % nshards];
 
-	game_number = game_num;	// current game number
-	g = get_game(game_number);	// get current game
+	while ( ok ) {
+		/* the inventory is taken without the lock, the game's */
+		/* inventory is written before its number is published */
+		game_number = __atomic_load_n(&shard->game_number, __ATOMIC_ACQUIRE);
+		g = get_game(game_number);	// get current game
+		round = __atomic_load_n(&g->round, __ATOMIC_SEQ_CST);
+		if (round & 1) {
+			continue;	// a late look at a game being reused
+		}
 
-	for (i=0; i<6; i++) {
-		if (g->inv[i] - temp[i] < 0) {	// checks if player is greedy
+		if (!catalog_reserve(g->inv, req)) {	// checks if player is greedy
 			ok = 0;
+			break;
 		}
-	}
 
-	if( sum > quota ) {	// checks if player is too greedy
-		ok = 0;
+		/* the lock only guards the slots */
+		lock_shard(shard);
+		if (shard->game_number == game_number && g->round == round) {
+			break;		// still the shard's game, keep the lock
+		}
+		/* the game filled up meanwhile, try the next one, if it */
+		/* was even reused the inventory we took is already gone, */
+		/* it is given back only to the round it was taken from */
+		unlock_at(&shard->lock, P_ADMIT);
+		if (__atomic_load_n(&g->round, __ATOMIC_SEQ_CST) == round) {
+			catalog_release(g->inv, req, req->n);
+		}
 	}
 
 	if ( ok ) {		// player is approved by the server!
-		for (i=0; i<6; i++) {
-			g->inv[i] -= temp[i];	// decrease server's inventory
-		}
-		send(cl, "OK\n", 4, 0);		// send ok message to player
+		/* take the first free slot, waiting players may have left */
+		for (i=0; g->roster.fd[i]; i++);
 		/* save player's name for the pretty "show info" function */
-		g->names[g->active] = calloc(MAX, sizeof(char));
-		strncpy(g->names[g->active], name, strlen(name));
-		g->players[g->active++] = cl;	// save player's file descriptor
+		memset(g->roster.name[i], 0, NAMELEN);
+		strncpy(g->roster.name[i], name, NAMELEN - 1);	// \0 kept
+		g->roster.fd[i] = cl;	// save player's file descriptor
+		open_queue(&g->out[i], cl);	// and his outbound queue
+		if (g->active++ == 0) {	// one more player
+			stats_add(&stats.games, 1);
+		}
+		stats_add(&stats.players, 1);
+		stats_add(&stats.admitted, 1);
 
 		if (g->active >= maxplayers) {	// game is full!
-			/* set initial values to game */
-			/* dynamic memory allocation for games (nodes of linked list) */
-			g->next = (game_t) malloc(sizeof(*(g->next)));
-			g = g->next;	// get next game (next node)
-			/* set players' file descriptors to 0 */
-			g->players = (int *) calloc (maxplayers, sizeof(int));
-			/* set array of players' names to NULL */
-			g->names = (char **) calloc(maxplayers, sizeof(char));
-			/* set inventory resources to 0 */
-			g->inv = (int *) calloc (6, sizeof(int));
-			g->next = NULL;	// no next game
-			g->active = 0;	// no active players
-			game_num++;	// next game
-			/* each game has its own inventory */
-			read_inventory(inv_file);
+			g->started = 1;
+			pthread_cond_broadcast(&g->full);	// wake up the players
+			/* next game of the shard, numbers are shared by all */
+			/* shards, each game has its own inventory */
+			i = claim_game(shard);
+			__atomic_store_n(&shard->game_number, i, __ATOMIC_RELEASE);
 		}
 	}
 	else {	// server disapproves of the player
-		send(cl, "Try next time..\n", 17, 0);	// send message..
+		stats_add(&stats.rejected, 1);
+		proto_send(cl, MSG_REJECT, "Try next time..\n", 16, 0);	// send message..
 		printf("Could not add %s\n", name);	// sorry
-		pthread_mutex_unlock(&mutex);	// unlock mutex
-		pthread_exit(&ret);		// terminate player's thread
+		return 0;
 	}
 
 	/****** player inserted to game ******/
-	pthread_mutex_unlock(&mutex);	// next
+	unlock_at(&shard->lock, P_ADMIT);	// next
+	proto_send(cl, MSG_OK, "OK\n", 3, 0);	// send ok message to player
 
 	return game_number;		// return player's game number
 }
 
+/* a player who left a running game comes back under the same */
+/* name (-m): the seat must be free and still have the name, in */
+/* the round of the game that started and is not over, then the */
+/* player keeps the resources taken the first time and gets OK, */
+/* chat waits until START and the replay (see replay_history) */
+/* returns the game number, 0 if there is no seat to go back to */
+int rejoin_player(int cl, char *name) {
+	unsigned long seat;	// where the player sat
+	int game_number;
+	shard_t *shard;		// the game's lobby
+	outq_t *q;		// the seat's queue
+	game_t g;
+	int i;
+
+	lock_at(&seat_lock, P_HISTORY);
+	seat = history_take(seats, name);
+	unlock_at(&seat_lock, P_HISTORY);
+	game_number = seat & 0xffffffff;
+	if (!game_number || !(g = get_game(game_number))) {
+		return 0;
+	}
+	shard = g->shard;	// the round is checked under its lock
+	lock_shard(shard);
+	if ((unsigned) g->round != seat >> 32 || shard->game_number == game_number || !g->active) {
+		unlock_at(&shard->lock, P_ADMIT);
+		return 0;	// the game is over, or was reused
+	}
+	for (i=0; i<maxplayers && (g->roster.fd[i] ||
+			strncmp(g->roster.name[i], name, NAMELEN)); i++);
+	if (i == maxplayers) {
+		unlock_at(&shard->lock, P_ADMIT);
+		return 0;	// somebody else's seat
+	}
+	q = &g->out[i];
+	lock_at(&q->lock, P_SLOT);
+	q->since = REPLAY;	// no chat yet
+	unlock_at(&q->lock, P_SLOT);
+	g->roster.fd[i] = cl;
+	open_queue(q, cl);
+	g->active++;
+	stats_add(&stats.players, 1);
+	stats_add(&stats.admitted, 1);
+	unlock_at(&shard->lock, P_ADMIT);
+
+	proto_send(cl, MSG_OK, "OK\n", 3, 0);	// send ok message to player
+	printf("%s is back in game %d\n", name, game_number);
+	return game_number;
+}
+
+/* the clock is read only when the lock is taken */
+void lock_shard(shard_t *shard) {
+	profile_t *me;		// -P
+	long t, now;
+
+	if (pthread_mutex_trylock(&shard->lock) == 0) {
+		histo_add(&stats.lock_wait, 0);		// no wait
+		if (profiling) {
+			me = my_prof();
+			t = stats_ns();
+			prof_taken(&me->p, me->since, P_ADMIT, t, t);
+		}
+		return;
+	}
+	t = stats_ns();
+	pthread_mutex_lock(&shard->lock);
+	now = stats_ns();
+	histo_add(&stats.lock_wait, now - t);
+	if (profiling) {
+		me = my_prof();
+		prof_taken(&me->p, me->since, P_ADMIT, t, now);
+	}
+}
+
+/* with -P the wait for the lock and the time it is held */
+/* are kept for the call site */
+void lock_at(pthread_mutex_t *lock, int site) {
+	profile_t *me;
+	long t;
+
+	if (!profiling) {
+		pthread_mutex_lock(lock);
+		return;
+	}
+	me = my_prof();
+	t = stats_ns();
+	pthread_mutex_lock(lock);
+	prof_taken(&me->p, me->since, site, t, stats_ns());
+}
+
+void unlock_at(pthread_mutex_t *lock, int site) {
+	profile_t *me;
+
+	if (profiling) {
+		me = my_prof();
+		prof_released(&me->p, me->since, site);
+	}
+	pthread_mutex_unlock(lock);
+}
+
+/* the lock is not held while waiting */
+int wait_at(pthread_cond_t *cond, pthread_mutex_t *lock, struct timespec *t, int site) {
+	profile_t *me = profiling ? my_prof() : NULL;
+	int ret;
+
+	if (profiling) {
+		prof_released(&me->p, me->since, site);
+	}
+	ret = pthread_cond_timedwait(cond, lock, t);
+	if (profiling) {
+		prof_retaken(me->since, site);
+	}
+	return ret;
+}
+
+/* a thread takes a profile of a finished thread or makes one, */
+/* profiles are never freed, so the numbers of past threads stay */
+profile_t *my_prof() {
+	static __thread profile_t *mine;	// this thread's
+	profile_t *p;
+
+	if (mine) {
+		return mine;
+	}
+	for (p = __atomic_load_n(&profiles, __ATOMIC_ACQUIRE); p; p = p->next) {
+		if (!__atomic_load_n(&p->owned, __ATOMIC_RELAXED) &&
+				!__atomic_exchange_n(&p->owned, 1, __ATOMIC_ACQ_REL)) {
+			break;	// a finished thread's
+		}
+	}
+	if (!p) {
+		if (!(p = calloc(1, sizeof(profile_t)))) {
+			perror("calloc()\nerrno"); exit(1);	// debugging
+		}
+		p->owned = 1;
+		p->next = __atomic_load_n(&profiles, __ATOMIC_RELAXED);
+		while (!__atomic_compare_exchange_n(&profiles, &p->next, p,
+				1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+	}
+	mine = p;
+	pthread_setspecific(prof_key, p);	// free_prof at exit
+	return p;
+}
+
+void free_prof(void *p) {
+	__atomic_store_n(&((profile_t *) p)->owned, 0, __ATOMIC_RELEASE);
+}
+
 void remove_player(int cl, int game_number) {
 	int i;
 	game_t g = get_game(game_number);	// get player's game
 
 	for (i=0; i<maxplayers; i++) {
-		if (g->players[i] == cl) {	// find player
-			g->players[i] = 0;	// and remove his file descriptor
+		if (g->roster.fd[i] == cl) {	// find player
+			g->roster.fd[i] = 0;	// and remove his file descriptor
+		}
+	}
+}
+
+int player_slot(game_t g, int cl) {
+	int i;
+
+	for (i=0; i<maxplayers && g->roster.fd[i] != cl; i++);
+	return i;
+}
+
+/****** outbound queues ******/
+
+/* sends a framed message to every other player of the game */
+/* nobody waits for a slow player, his messages are queued */
+void fanout(game_t g, int from, char *frame, size_t len) {
+	msg_t *m;	// shared by the recipients
+	int i, staged;
+
+	if (!(m = malloc(sizeof(msg_t) + len))) {
+		return;		// message is lost
+	}
+	m->refs = 1;		// ours
+	m->pos = 0;		// not in the history
+	m->len = len;
+	memcpy(m->frame, frame, len);
+	stats_add(&stats.chats, 1);
+	if (history || history_path) {
+		remember(g, m);
+	}
+	staged = zero_copy && stage_msg(m);
+
+	for (i=0; i<maxplayers; i++) {
+		if (i != from && g->roster.fd[i] &&
+				queue_msg(&g->out[i], m, staged) == -1) {
+			printf("Player %s is too slow, kicked..\n", g->roster.name[i]);
+		}
+	}
+	if (staged) {
+		zcopy_unstage(&zc);
+	}
+	put_msg(m);
+}
+
+/* -z: the message goes into this thread's stage, opened the */
+/* first time, returns 0 if it must be copied as usual */
+int stage_msg(msg_t *m) {
+	if (!zc_state) {
+		zc_state = zcopy_open(&zc) == 0 ? 1 : -1;
+		if (zc_state == -1) {
+			perror("zcopy_open()\nerrno");	// copies, as without -z
+		}
+	}
+	return zc_state == 1 && zcopy_stage(&zc, m->frame, m->len) == 0;
+}
+
+/* appends the message to the queue and writes what it can */
+/* over the high-water mark the message is dropped, or the */
+/* player is kicked (-k), returns -1 when he gets kicked */
+/* a staged message (-z) goes straight from the stage to an */
+/* empty queue's socket, only the part it did not take is queued */
+int queue_msg(outq_t *q, msg_t *m, int staged) {
+	int kicked = 0;
+	ssize_t n, off = 0;	// bytes spliced
+
+	lock_at(&q->lock, P_RELAY);
+	if (!q->fd || q->kicked) {
+		unlock_at(&q->lock, P_RELAY);
+		return 0;	// nobody there
+	}
+	if (m->pos < q->since) {
+		unlock_at(&q->lock, P_RELAY);
+		return 0;	// replayed, or waits for the replay
+	}
+	if (q->bytes + m->len > hiwat) {	// too slow
+		q->dropped++;
+		if (kick_laggards) {
+			q->kicked = kicked = 1;
+			shutdown(q->fd, SHUT_RDWR);	// his reader sees the end
+		}
+		unlock_at(&q->lock, P_RELAY);
+		return -kicked;
+	}
+	if (staged && !q->count && (n = zcopy_send(&zc, q->fd, m->len)) > 0) {
+		stats_add(&stats.bytes, n);
+		if ((size_t) n == m->len) {
+			unlock_at(&q->lock, P_RELAY);
+			return 0;	// all of it, nothing queued
+		}
+		off = n;
+	}
+	if (push_msg(q, m, off) == 0) {
+		arm_queue(q);
+	}
+	unlock_at(&q->lock, P_RELAY);
+	return 0;
+}
+
+/* the event loops (-e, -r) send START and reminders with this, */
+/* it goes out at once if nothing is queued before it, what the */
+/* socket does not take is queued like chat, so a loop never */
+/* waits for one player */
+void queue_ctl(outq_t *q, int type, const char *text, size_t len) {
+	char frame[PROTO_HDR + MAXCHAT];	// framed message
+	ssize_t n = 0;		// bytes the socket took
+	msg_t *m;		// the rest, queued
+
+	len = proto_pack(frame, type, text, len);
+	lock_at(&q->lock, P_RELAY);
+	if (!q->fd || q->kicked) {
+		unlock_at(&q->lock, P_RELAY);
+		return;		// nobody there
+	}
+	if (!q->count && (n = proto_try(q->fd, frame, len)) == (ssize_t) len) {
+		unlock_at(&q->lock, P_RELAY);
+		return;		// all of it
+	}
+	if (n >= 0 && (m = malloc(sizeof(msg_t) + len))) {
+		m->refs = 1;	// ours till it is queued
+		m->pos = 0;
+		m->len = len;
+		memcpy(m->frame, frame, len);
+		if (push_msg(q, m, n) == 0) {
+			arm_queue(q);
+		}
+		put_msg(m);
+	}
+	else if (n > 0) {
+		shutdown(q->fd, SHUT_RDWR);	// torn frame
+	}
+	unlock_at(&q->lock, P_RELAY);
+}
+
+/* appends the message, off bytes of it already written, called */
+/* with the queue locked, returns -1 if it was dropped */
+int push_msg(outq_t *q, msg_t *m, size_t off) {
+	msg_t **msgs;		// bigger ring
+	int i, size;
+
+	if (q->count == q->size) {	// grow the ring
+		size = q->size ? 2 * q->size : 16;
+		if (!(msgs = malloc(size * sizeof(msg_t *)))) {
+			q->dropped++;
+			return -1;
+		}
+		for (i=0; i<q->count; i++) {
+			msgs[i] = q->msgs[(q->head + i) % q->size];
+		}
+		free(q->msgs);
+		q->msgs = msgs;
+		q->head = 0;
+		q->size = size;
+	}
+	__atomic_add_fetch(&m->refs, 1, __ATOMIC_RELAXED);
+	if (!q->count) {
+		q->off = off;	// the rest of a spliced message
+	}
+	q->msgs[(q->head + q->count++) % q->size] = m;
+	q->bytes += m->len - off;
+	return 0;
+}
+
+/* writes what the socket takes, what does not fit is written */
+/* when the socket is writable, called with the queue locked */
+void arm_queue(outq_t *q) {
+	struct epoll_event ev;	// writable interest
+
+	if (flush_queue(q) == 0 && q->count && !q->armed) {
+		__atomic_store_n(&q->armed, 1, __ATOMIC_RELEASE);
+		if (event_mode) {
+			ev.events = EPOLLIN | EPOLLOUT;
+			ev.data.fd = q->fd;
+			epoll_ctl(epfd, EPOLL_CTL_MOD, q->fd, &ev);
+		}
+		else if (q->wake != -1) {
+			eventfd_write(q->wake, 1);	// player's thread
+		}
+	}
+}
+
+/* writes the queued messages, many per system call, until the */
+/* socket is full, called with the queue locked */
+/* returns -1 if the player is gone */
+int flush_queue(outq_t *q) {
+	struct iovec iov[MAXIOV];	// queued messages
+	struct msghdr mh;		// vectored write
+	msg_t *m;		// first message
+	ssize_t n;
+	int i;
+
+	while (q->count) {
+		for (i=0; i<q->count && i<MAXIOV; i++) {
+			m = q->msgs[(q->head + i) % q->size];
+			iov[i].iov_base = m->frame + (i ? 0 : q->off);
+			iov[i].iov_len = m->len - (i ? 0 : q->off);
+		}
+		memset(&mh, 0, sizeof(mh));
+		mh.msg_iov = iov;
+		mh.msg_iovlen = i;
+		if ((n = sendmsg(q->fd, &mh, MSG_DONTWAIT | MSG_NOSIGNAL)) == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return errno == EAGAIN ? 0 : -1;
+		}
+		q->bytes -= n;
+		stats_add(&stats.bytes, n);
+		while (n > 0) {		// remove what was written
+			m = q->msgs[q->head];
+			if ((size_t) n < m->len - q->off) {
+				q->off += n;	// the rest of it later
+				break;
+			}
+			n -= m->len - q->off;
+			q->off = 0;
+			q->head = (q->head + 1) % q->size;
+			q->count--;
+			put_msg(m);
+		}
+	}
+	return 0;
+}
+
+/* the player's socket is writable again */
+void drain_queue(outq_t *q) {
+	struct epoll_event ev;	// back to reading only
+
+	lock_at(&q->lock, P_DRAIN);
+	if (q->fd && (flush_queue(q) == -1 || !q->count) && q->armed) {
+		__atomic_store_n(&q->armed, 0, __ATOMIC_RELEASE);
+		if (event_mode) {
+			ev.events = EPOLLIN;
+			ev.data.fd = q->fd;
+			epoll_ctl(epfd, EPOLL_CTL_MOD, q->fd, &ev);
+		}
+	}
+	unlock_at(&q->lock, P_DRAIN);
+}
+
+/* called with the shard's mutex locked, when a player takes the slot */
+void open_queue(outq_t *q, int cl) {
+	lock_at(&q->lock, P_SLOT);
+	q->fd = cl;
+	q->wake = -1;		// his thread sets it
+	q->armed = q->kicked = 0;
+	q->dropped = 0;
+	unlock_at(&q->lock, P_SLOT);
+}
+
+void close_queue(outq_t *q) {
+	lock_at(&q->lock, P_SLOT);
+	while (q->count) {	// nobody will read them
+		put_msg(q->msgs[q->head]);
+		q->head = (q->head + 1) % q->size;
+		q->count--;
+	}
+	q->head = 0;
+	q->off = q->bytes = 0;
+	q->fd = 0;
+	q->wake = -1;
+	q->armed = 0;
+	q->since = 0;
+	unlock_at(&q->lock, P_SLOT);
+}
+
+void put_msg(msg_t *m) {
+	if (__atomic_sub_fetch(&m->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+		free(m);
+	}
+}
+
+/****** chat history (-m, -l) ******/
+
+/* the ring holds a reference, the oldest message is let go */
+/* with -l the log's list holds another till it is written */
+void remember(game_t g, msg_t *m) {
+	msg_t *old;		// the one it replaces
+
+	lock_at(&g->hist_lock, P_HISTORY);
+	m->pos = g->hist_head;
+	old = g->hist[m->pos % HISTORY];
+	g->hist[m->pos % HISTORY] = m;
+	__atomic_add_fetch(&m->refs, 1, __ATOMIC_RELAXED);
+	if (history_path) {
+		m->log = NULL;
+		__atomic_add_fetch(&m->refs, 1, __ATOMIC_RELAXED);
+		if (g->log_last) {
+			g->log_last->log = m;
+		}
+		else {
+			__atomic_store_n(&g->log_first, m, __ATOMIC_RELAXED);
+		}
+		g->log_last = m;
+	}
+	__atomic_store_n(&g->hist_head, m->pos + 1, __ATOMIC_RELEASE);
+	unlock_at(&g->hist_lock, P_HISTORY);
+	if (old) {
+		put_msg(old);
+	}
+}
+
+/* a player who came back gets the last -m messages of this round */
+/* in one vectored write, the queue's, newer ones follow as usual */
+void replay_history(game_t g, int slot) {
+	outq_t *q = &g->out[slot];	// the player's queue
+	unsigned long pos;		// first message replayed
+
+	lock_at(&g->hist_lock, P_HISTORY);
+	pos = g->hist_head - g->hist_start > (unsigned long) history ?
+		g->hist_head - history : g->hist_start;
+	lock_at(&q->lock, P_SLOT);
+	if (q->fd && !q->kicked) {
+		for (; pos != g->hist_head; pos++) {
+			push_msg(q, g->hist[pos % HISTORY], 0);
+		}
+		arm_queue(q);
+	}
+	q->since = g->hist_head;	// from now on, chat as usual
+	unlock_at(&q->lock, P_SLOT);
+	unlock_at(&g->hist_lock, P_HISTORY);
+}
+
+/* every FLUSH ms the new messages of every game go to the log, */
+/* a game's list is only locked to be taken whole, never while */
+/* the log is written, however much a busy game said meanwhile */
+void* flush_history(void *arg) {
+	msg_t *m, *next;	// a game's new messages, oldest first
+	int i, stop, failed = 0;
+	game_t g;
+
+	do {
+		stop = __atomic_load_n(&stop_flushing, __ATOMIC_ACQUIRE);
+		for (i=1; i<=__atomic_load_n(&game_num, __ATOMIC_ACQUIRE); i++) {
+			if (!(g = get_game(i)) || !__atomic_load_n(&g->log_first, __ATOMIC_RELAXED)) {
+				continue;	// being created, or nothing new
+			}
+			lock_at(&g->hist_lock, P_HISTORY);
+			m = g->log_first;
+			g->log_first = g->log_last = NULL;
+			unlock_at(&g->hist_lock, P_HISTORY);
+
+			for (; m; m = next) {
+				next = m->log;
+				if (!failed && hlog_append(&hlog, i, m->frame, m->len) == -1) {
+					perror("hlog_append()\nerrno");	// no more logging
+					failed = 1;
+				}
+				put_msg(m);
+			}
+		}
+		if (!stop) {
+			usleep(FLUSH * 1000);
+		}
+	} while (!stop);
+	if (!failed) {
+		hlog_close(&hlog);
+	}
+	return NULL;
+}
+
+/****** event loop (-e) ******/
+
+/* one thread waits on every socket with epoll */
+/* admission, waiting room and chat are driven by readiness events */
+void event_loop() {
+	struct epoll_event ev;	// epoll event
+	struct rlimit rl;	// open files limit
+	int i;
+
+	/* every idle player costs one file descriptor */
+	if (getrlimit(RLIMIT_NOFILE, &rl) == 0) {
+		rl.rlim_cur = rl.rlim_max;	// as many as we are allowed
+		setrlimit(RLIMIT_NOFILE, &rl);
+	}
+
+	if ((epfd = epoll_create1(0)) == -1) {
+		perror("epoll_create1()\nerrno"); exit(1);	// debugging
+	}
+	for (i=0; i<3; i++) {	// Unix and TCP listening sockets, router
+		if ((ev.data.fd = i == 0 ? server : i == 1 ? tcp_server : router) == -1) {
+			continue;	// not in use
+		}
+		fcntl(ev.data.fd, F_SETFL, fcntl(ev.data.fd, F_GETFL) | O_NONBLOCK);
+		ev.events = EPOLLIN;	// new players
+		if (epoll_ctl(epfd, EPOLL_CTL_ADD, ev.data.fd, &ev) == -1) {
+			perror("epoll_ctl()\nerrno"); exit(1);	// debugging
+		}
+	}
+	serve_events();
+}
+
+/* the listening sockets are only in the epoll of -e, the queue */
+/* of new connections only in the epoll of a reactor */
+void serve_events() {
+	struct epoll_event events[MAXEVENTS];	// epoll events
+	conn_t *c;		// ready connection
+	int i, n, timeout;
+
+	while (1) {
+		/* sleep until a socket is ready or a reminder is due */
+		timeout = -1;		// no waiting players, no timeout
+		if (wait_head != -1) {
+			timeout = conns[wait_head].deadline - now_ms();
+			if (timeout < 0) timeout = 0;
+		}
+
+		n = epoll_wait(epfd, events, MAXEVENTS, timeout);
+		if (n == -1 && errno != EINTR) {	// signals interrupt
+			perror("epoll_wait()\nerrno"); exit(1);	// debugging
+		}
+
+		for (i=0; i<n; i++) {
+			if (events[i].data.fd == server || events[i].data.fd == tcp_server) {
+				accept_players(events[i].data.fd);	// new players
+				continue;
+			}
+			if (events[i].data.fd == router) {
+				route_players();	// new players too
+				continue;
+			}
+			if (my_reactor && events[i].data.fd == my_reactor->wake) {
+				take_conns();	// from the acceptor
+				continue;
+			}
+			c = &conns[events[i].data.fd];
+			if (events[i].events & EPOLLOUT && c->state != CL_JOIN) {
+				drain_queue(&get_game(c->game_number)->out[c->slot]);
+			}
+			if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+				player_event(events[i].data.fd);
+			}
+		}
+		remind_players();	// "Please wait..." messages
+	}
+}
+
+/****** reactors (-r) ******/
+
+void start_reactors() {
+	struct rlimit rl;	// open files limit
+	cpu_set_t cpus;		// a reactor's core
+	pthread_t thr;		// a reactor
+	long ncpu = sysconf(_SC_NPROCESSORS_ONLN);	// cores
+	int i, j;
+
+	/* every idle player costs one file descriptor */
+	if (getrlimit(RLIMIT_NOFILE, &rl) == 0) {
+		rl.rlim_cur = rl.rlim_max;	// as many as we are allowed
+		setrlimit(RLIMIT_NOFILE, &rl);
+	}
+
+	if (!(reactors = aligned_alloc(CACHELINE, nreactors * sizeof(reactor_t)))) {
+		perror("aligned_alloc()\nerrno"); exit(1);	// debugging
+	}
+	memset(reactors, 0, nreactors * sizeof(reactor_t));
+	for (i=0; i<nreactors; i++) {
+		reactors[i].id = i;
+		for (j=0; j<CONNQ; j++) {
+			reactors[i].inbox[j].seq = j;	// free for turn j
+		}
+		if ((reactors[i].wake = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) == -1) {
+			perror("eventfd()\nerrno"); exit(1);	// debugging
+		}
+		if ((reactors[i].room = eventfd(0, EFD_CLOEXEC)) == -1) {	// blocks
+			perror("eventfd()\nerrno"); exit(1);	// debugging
+		}
+		if (pthread_create(&thr, NULL, reactor_loop, &reactors[i]) != 0) {
+			perror("pthread_create()\nerrno"); exit(1);	// debugging
+		}
+		/* one core each, they keep their players' data warm */
+		CPU_ZERO(&cpus);
+		CPU_SET(i % (ncpu > 0 ? ncpu : 1), &cpus);
+		pthread_setaffinity_np(thr, sizeof(cpus), &cpus);	// not allowed is fine
+		pthread_detach(thr);	// don't wait for thread
+	}
+	printf("~~~ %d reactors serve the players ~~~\n\n", nreactors);
+}
+
+void* reactor_loop(void *arg) {
+	struct epoll_event ev;	// the queue's eventfd
+
+	my_reactor = (reactor_t *) arg;
+	if ((epfd = epoll_create1(0)) == -1) {
+		perror("epoll_create1()\nerrno"); exit(1);	// debugging
+	}
+	ev.events = EPOLLIN;	// new connections
+	ev.data.fd = my_reactor->wake;
+	if (epoll_ctl(epfd, EPOLL_CTL_ADD, my_reactor->wake, &ev) == -1) {
+		perror("epoll_ctl()\nerrno"); exit(1);	// debugging
+	}
+	serve_events();		// never returns
+	return NULL;
+}
+
+/* the reactor with the fewest connections, round robin among */
+/* equals, so a burst is spread evenly before it is even counted */
+/* new connections and new games go to it */
+reactor_t *pick_reactor() {
+	int next = __atomic_fetch_add(&next_reactor, 1, __ATOMIC_RELAXED);
+	reactor_t *r, *best = NULL;
+	int i;
+
+	for (i=0; i<nreactors; i++) {
+		r = &reactors[(next + i) % nreactors];
+		if (!best || __atomic_load_n(&r->load, __ATOMIC_RELAXED) <
+				__atomic_load_n(&best->load, __ATOMIC_RELAXED)) {
+			best = r;
+		}
+	}
+	return best;
+}
+
+/* any thread may queue a connection for a reactor, each cell's */
+/* sequence number tells whose turn it is, so producers only */
+/* race for the tail, returns -1 if the queue is full */
+int pass_conn(reactor_t *r, int fd, conn_t *c) {
+	unsigned long pos = __atomic_load_n(&r->tail, __ATOMIC_RELAXED);
+	inbox_t *cell;
+	long turn;
+
+	while (1) {
+		cell = &r->inbox[pos % CONNQ];
+		turn = (long) (__atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE) - pos);
+		if (turn == 0 && __atomic_compare_exchange_n(&r->tail, &pos, pos + 1,
+				1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+			break;		// the cell is ours
+		}
+		if (turn < 0) {
+			return -1;	// full, the reactor is behind
+		}
+		if (turn > 0) {
+			pos = __atomic_load_n(&r->tail, __ATOMIC_RELAXED);
+		}
+	}
+	cell->fd = fd;
+	cell->conn = *c;
+	__atomic_store_n(&cell->seq, pos + 1, __ATOMIC_RELEASE);
+	eventfd_write(r->wake, 1);
+	return 0;
+}
+
+/* the acceptor leaves half of every queue to the players passed */
+/* between reactors, if it is full it sleeps until the reactor */
+/* takes some and new players wait in the listen backlog */
+/* waiting is raised before the queue is looked at again, so a */
+/* take that empties it after we looked always sees it and writes */
+/* room, a write after we gave up waiting only wakes us once more */
+void dispatch(int fd) {
+	reactor_t *r = pick_reactor();
+	conn_t c;		// a new connection
+	eventfd_t n;		// takes, merged
+
+	memset(&c, 0, sizeof(conn_t));
+	c.state = CL_JOIN;		// waits for player's request
+	c.accepted = now_us();		// for the latency stats
+	c.prev = c.next = -1;
+	while (__atomic_load_n(&r->tail, __ATOMIC_RELAXED) -
+			__atomic_load_n(&r->head, __ATOMIC_ACQUIRE) >= CONNQ / 2 ||
+			pass_conn(r, fd, &c) == -1) {
+		__atomic_store_n(&r->waiting, 1, __ATOMIC_SEQ_CST);
+		if (__atomic_load_n(&r->tail, __ATOMIC_SEQ_CST) -
+				__atomic_load_n(&r->head, __ATOMIC_SEQ_CST) >= CONNQ / 2) {
+			eventfd_read(r->room, &n);	// take_conns writes it
+		}
+		__atomic_store_n(&r->waiting, 0, __ATOMIC_RELAXED);
+	}
+}
+
+/* the eventfd is read before the queue, a cell filled after we */
+/* looked, or still being filled, writes it again and wakes us up */
+void take_conns() {
+	reactor_t *r = my_reactor;
+	inbox_t *cell;
+	eventfd_t n;		// wakeups, merged
+	unsigned long head = r->head;	// where we began
+
+	eventfd_read(r->wake, &n);
+	while (1) {
+		cell = &r->inbox[r->head % CONNQ];
+		if (__atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE) != r->head + 1) {
+			break;		// empty
+		}
+		adopt_conn(cell->fd, &cell->conn);
+		__atomic_store_n(&cell->seq, r->head + CONNQ, __ATOMIC_RELEASE);
+		__atomic_store_n(&r->head, r->head + 1, __ATOMIC_SEQ_CST);
+	}
+	/* there is room now, the acceptor may be asleep waiting for it */
+	if (r->head != head && __atomic_exchange_n(&r->waiting, 0, __ATOMIC_SEQ_CST)) {
+		eventfd_write(r->room, 1);
+	}
+}
+
+/* the player was admitted to a game of another reactor, he is */
+/* passed on with everything read so far, we forget him first */
+/* so his next event is seen there only */
+void move_conn(int cl, reactor_t *r) {
+	conn_t *c = &conns[cl];	// player's connection
+
+	epoll_ctl(epfd, EPOLL_CTL_DEL, cl, NULL);
+	if (pass_conn(r, cl, c) == -1) {
+		/* only if that reactor is stuck, he must not wait */
+		/* here for a game that starts there */
+		printf("Reactor %d is full, %s dropped\n", r->id, c->name);
+		wait_push(cl);		// drop_player takes him out again
+		drop_player(cl);
+		return;
+	}
+	__atomic_sub_fetch(&my_reactor->load, 1, __ATOMIC_RELAXED);
+	memset(c, 0, sizeof(conn_t));	// his messages went along
+}
+
+void accept_players(int listener) {
+	int new_fd;		// player's file descriptor
+
+	while ((new_fd = accept4(listener, NULL, NULL, SOCK_NONBLOCK)) != -1) {
+		if (listener == tcp_server) {
+			tcp_nodelay(new_fd);	// chat leaves at once
+		}
+		open_conn(new_fd);
+	}
+	if (errno != EAGAIN && errno != EWOULDBLOCK) {
+		perror("accept()\nerrno");	// out of descriptors, try later
+	}
+}
+
+/* the router's link is read until it is empty, like a listener */
+void route_players() {
+	int new_fd;		// player's file descriptor
+
+	while ((new_fd = router_recv_fd(router)) != -1) {
+		stats_add(&stats.routed, 1);
+		fcntl(new_fd, F_SETFL, fcntl(new_fd, F_GETFL) | O_NONBLOCK);
+		open_conn(new_fd);
+	}
+	if (errno == EPIPE) {
+		printf("Router closed, no more players\n");
+		epoll_ctl(epfd, EPOLL_CTL_DEL, router, NULL);	// reports fail quietly
+	}
+}
+
+void open_conn(int new_fd) {
+	conn_t c;		// player's connection
+
+	memset(&c, 0, sizeof(conn_t));
+	c.state = CL_JOIN;		// waits for player's request
+	c.accepted = now_us();		// for the latency stats
+	c.prev = c.next = -1;
+	adopt_conn(new_fd, &c);
+}
+
+/* a new connection, or a player passed on by another reactor */
+void adopt_conn(int fd, conn_t *from) {
+	struct epoll_event ev;	// epoll event
+	conn_t *c;		// player's connection
+
+	if (fd >= max_conns) {	// grow connections table
+		c = realloc(conns, (fd + 1024) * sizeof(conn_t));
+		if (!c) {
+			perror("realloc()\nerrno"); close(fd); return;
+		}
+		conns = c;
+		max_conns = fd + 1024;
+	}
+	c = &conns[fd];
+	*c = *from;
+
+	ev.events = EPOLLIN;
+	ev.data.fd = fd;
+	if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+		perror("epoll_ctl()\nerrno"); close(fd);
+		return;
+	}
+	if (my_reactor) {
+		__atomic_add_fetch(&my_reactor->load, 1, __ATOMIC_RELAXED);
+	}
+	if (c->state == CL_WAIT) {
+		settle_player(fd);	// admitted by another reactor
+	}
+}
+
+void player_event(int cl) {
+	conn_t *c = &conns[cl];	// player's connection
+	int n;
+	int ok, sum;		// player's request
+	request_t req;		// player's resources
+	char frame[PROTO_HDR + MAXCHAT + 1];	// message for the others
+	size_t len;		// payload's, then frame's length
+	char *text;		// player's message
+	int type;		// message type
+
+	n = proto_read(cl, &c->in);
+	if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+		return;		// nothing to read after all
+	}
+	if (n <= 0) {		// player crashed
+		drop_player(cl);
+		return;
+	}
+
+	/* one read may hold many messages, or only part of one */
+	while (proto_next(&c->in, &type, &text, &len)) {
+		switch (c->state) {
+		case CL_JOIN:		// first message is the request
+			sum = 0;
+			ok = type == MSG_JOIN &&
+				catalog_parse(&catalog, quota, text, len, c->name, MAX, &req, &sum);
+			if (!(c->game_number = admit_player(cl, c->name, &req, sum, ok))) {
+				drop_player(cl);	// server disapproves
+				return;
+			}
+			histo_add(&stats.admission, now_us() - c->accepted);	// accept-to-OK latency
+			c->slot = player_slot(get_game(c->game_number), cl);
+			c->state = CL_WAIT;
+			if (my_reactor && get_game(c->game_number)->reactor != my_reactor->id) {
+				move_conn(cl, &reactors[get_game(c->game_number)->reactor]);
+				return;		// the rest is read there
+			}
+			settle_player(cl);	// waits for the other players
+			break;
+
+		case CL_WAIT:		// players do not talk before START
+			break;
+
+		case CL_PLAY:		// chatting
+			if (type != MSG_CHAT) {
+				break;	// players only chat now
+			}
+			/* customize the message, so it shows who sent it */
+			len = proto_printf(frame, MAXCHAT, MSG_CHAT, "%s : %.*s",
+					c->name, (int) len, text);
+			fanout(get_game(c->game_number), c->slot, frame, len);
+			break;
+		}
+	}
+}
+
+/* with reactors a game starts when its last player has reached */
+/* its reactor, players passed on may still be on their way */
+/* a player who came back (-m) starts alone */
+void settle_player(int cl) {
+	conn_t *c = &conns[cl];	// player's connection
+	game_t g = get_game(c->game_number);	// his game
+	int settled;		// players that reached the game
+
+	wait_push(cl);		// waits for the other players
+	settled = my_reactor ? ++g->settled : g->active;
+	if (g->out[c->slot].since == REPLAY) {
+		start_player(cl);	// the game is running
+	}
+	else if (settled >= maxplayers) {
+		start_game(c->game_number);	// game is full!
+	}
+}
+
+void start_game(int game_number) {
+	game_t g = get_game(game_number);	// full game
+	int i;
+
+	for (i=0; i<maxplayers; i++) {
+		if (g->roster.fd[i]) {
+			start_player(g->roster.fd[i]);
 		}
 	}
 }
+
+void start_player(int cl) {
+	conn_t *c = &conns[cl];	// player's connection
+	game_t g = get_game(c->game_number);	// the player's game
+
+	if (c->state != CL_WAIT) {
+		return;		// already playing
+	}
+	wait_pop(cl);		// leaves the waiting room
+	c->state = CL_PLAY;
+	queue_ctl(&g->out[c->slot], MSG_START, "START\n", 6);	// send start message
+	printf("%s is ready!\n", c->name);	// players are ready!
+	if (g->out[c->slot].since == REPLAY) {
+		replay_history(g, c->slot);	// what was said meanwhile
+	}
+}
+
+void drop_player(int cl) {
+	conn_t *c = &conns[cl];	// player's connection
+
+	if (c->state != CL_JOIN) {
+		wait_pop(cl);			// if still waiting
+		if (my_reactor && get_game(c->game_number)->reactor == my_reactor->id) {
+			get_game(c->game_number)->settled--;	// he had reached it
+		}
+		close_queue(&get_game(c->game_number)->out[c->slot]);
+		printf("Player %s left..\n", c->name);	// inform the others
+		if (leave_game(cl, c->game_number)) {	// empty game
+			printf("All players left.\nGame Over\n\n");
+		}
+	}
+	else if (!c->name[0]) {		// no request at all
+		printf("Could not add player..\n");
+	}
+	proto_free(&c->in);	// unread messages
+	close(cl);	// also removes it from epoll
+	c->state = CL_JOIN;
+	if (my_reactor) {
+		__atomic_sub_fetch(&my_reactor->load, 1, __ATOMIC_RELAXED);
+	}
+}
+
+/* waiting players get a reminder every REMIND ms */
+/* everybody waits for the same time, so the list stays sorted */
+void wait_push(int cl) {
+	conn_t *c = &conns[cl];
+
+	c->deadline = now_ms() + REMIND;	// next reminder
+	c->prev = wait_tail;
+	c->next = -1;
+	if (wait_tail != -1) {
+		conns[wait_tail].next = cl;
+	}
+	else {
+		wait_head = cl;
+	}
+	wait_tail = cl;
+}
+
+void wait_pop(int cl) {
+	conn_t *c = &conns[cl];
+
+	if (c->state != CL_WAIT) {
+		return;		// not in the waiting room
+	}
+	if (c->prev != -1) conns[c->prev].next = c->next;
+	else wait_head = c->next;
+	if (c->next != -1) conns[c->next].prev = c->prev;
+	else wait_tail = c->prev;
+	c->prev = c->next = -1;
+}
+
+void remind_players() {
+	long now = now_ms();
+	int cl;
+
+	while ((cl = wait_head) != -1 && conns[cl].deadline <= now) {
+		queue_ctl(&get_game(conns[cl].game_number)->out[conns[cl].slot],
+				MSG_WAIT, "Please wait...\n", 15);	// waiting..
+		wait_pop(cl);
+		wait_push(cl);		// back of the queue
+	}
+}
+
+long now_ms() {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+long now_us() {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
@@ -0,0 +1,325 @@
+#define _GNU_SOURCE	// for memmem
+#include <stdio.h>	// standard input/output
+#include <stdlib.h>	// general purpose functions
+#include <string.h>	// string operations
+#include <unistd.h>	// miscellaneous functions
+#include <sys/un.h>	// for sockaddr_un structure
+#include <sys/socket.h>	// socket definitions
+#include <sys/types.h>	// various type definitions
+#include <sys/epoll.h>	// waits on every player at once
+#include <sys/resource.h>	// for the open files limit
+#include <signal.h>	// for handling signals
+#include <fcntl.h>	// file control options
+#include <errno.h>	// for the errno variable
+#include <time.h>	// for clock_gettime
+#include "../common/proto.h"	// framed messages
+#include "../common/net.h"	// Unix or TCP server
+
+#define MAX 16		// max size for small buffers
+#define MAXINV 64	// max inventory files
+#define MAXEVENTS 256	// max events per epoll_wait
+#define TICK 10		// ms between chat rounds
+
+/* headless players: one process, one epoll, N simulated players */
+/* that speak the same protocol as the player (client.c) */
+enum { LG_JOIN, LG_WAIT, LG_PLAY, LG_DONE };	// player states
+typedef struct player_t {	// everything for each simulated player
+	int fd;			// connection, 0 = not connected yet
+	int state;		// LG_JOIN, LG_WAIT, LG_PLAY or LG_DONE
+	long joined;		// when the request was sent (ns)
+	long next_chat;		// next chat message (ns)
+	frames_t in;		// server's messages, maybe partial
+} player_t;
+
+typedef struct samples_t {	// latencies of one kind
+	long *v;		// samples (ns)
+	long n, size;		// used and allocated
+} samples_t;
+
+player_t *players;	// simulated players
+int nplayers = 1000;	// how many
+double join_rate;	// joins per second, 0 = all at once
+double chat_rate;	// chat messages per second per player
+double duration = 5;	// seconds of chat after the last join
+char server_name[108] = "server";	// socket path or host:port
+char *inv[MAXINV];	// inventory files' contents
+int ninv;		// how many
+int epfd;		// epoll file descriptor
+
+samples_t admission;	// join to OK
+samples_t start;	// join to START
+samples_t fanout;	// chat sent to chat received
+long rejected, closed, sent, stalled;	// counters
+
+void read_inventory(char *);	// loads an inventory file
+void join_player(int);		// connects and sends the request
+void player_event(int);		// handles input of a player
+void poll_events(int);		// handles what is ready, waits up to ms
+void chat_round(long);		// players that are due send a message
+void add_sample(samples_t *, long);	// one more latency
+void report(char *, samples_t *);	// prints the percentiles
+int cmp_long(const void *, const void *);	// for qsort
+long now_ns(void);		// monotonic clock in nanoseconds
+
+// ./loadgen -n 3000 -j 500 -c 1 -d 10 -i inventory_1 -i inventory_2 server
+
+int main(int argc, char *argv[]) {
+	struct rlimit rl;	// open files limit
+	long begin, now, next_join, last_join, end;	// clock (ns)
+	int i, joined = 0;
+
+	for (i=1; i<argc; i++) {	// every argument is optional
+		if (!strcmp(argv[i], "-n") && i+1 < argc) {
+			nplayers = atoi(argv[++i]);	// simulated players
+		}
+		else if (!strcmp(argv[i], "-j") && i+1 < argc) {
+			join_rate = atof(argv[++i]);	// joins per second
+		}
+		else if (!strcmp(argv[i], "-c") && i+1 < argc) {
+			chat_rate = atof(argv[++i]);	// messages per second
+		}
+		else if (!strcmp(argv[i], "-d") && i+1 < argc) {
+			duration = atof(argv[++i]);	// seconds
+		}
+		else if (!strcmp(argv[i], "-i") && i+1 < argc && ninv < MAXINV) {
+			read_inventory(argv[++i]);	// players take turns
+		}
+		else if (argv[i][0] != '-') {
+			strncpy(server_name, argv[i], sizeof(server_name) - 1);
+		}
+		else {
+			printf("Run the load generator by writing:\n");
+			printf("./loadgen [-n <players>] [-j <joins_per_sec>] [-c <chats_per_sec>] [-d <seconds>] [-i <inventory>]... [<server_host | host:port>]\n");
+			exit(1);
+		}
+	}
+	if (nplayers < 1) {
+		printf("Players must be at least 1\n"); exit(1);
+	}
+	if (!ninv) {
+		inv[ninv++] = "ammo 1\n";	// the smallest request
+	}
+
+	/* every simulated player costs one file descriptor */
+	if (getrlimit(RLIMIT_NOFILE, &rl) == 0) {
+		rl.rlim_cur = rl.rlim_max;	// as many as we are allowed
+		setrlimit(RLIMIT_NOFILE, &rl);
+	}
+	signal(SIGPIPE, SIG_IGN);	// the server may go away
+	if (!(players = calloc(nplayers, sizeof(player_t)))) {
+		perror("calloc()\nerrno"); exit(1);	// debugging
+	}
+	if ((epfd = epoll_create1(0)) == -1) {
+		perror("epoll_create1()\nerrno"); exit(1);	// debugging
+	}
+
+	begin = next_join = now_ns();
+	last_join = 0;
+	end = 0;
+	while (!end || (now = now_ns()) < end) {
+		now = now_ns();
+		/* new players join at the given rate, replies that came */
+		/* meanwhile are read between joins, so a burst (-j 0) */
+		/* times each one when it arrives, not after the last join */
+		while (joined < nplayers && now >= next_join) {
+			join_player(joined++);
+			poll_events(0);
+			next_join = join_rate > 0 ? begin + joined * (1e9 / join_rate) : now;
+			if (joined == nplayers) {
+				last_join = now_ns();
+				end = last_join + duration * 1e9;
+			}
+		}
+		chat_round(now);
+		poll_events(TICK);
+	}
+
+	printf("players %d joined in %.3f s\n", nplayers, (last_join - begin) / 1e9);
+	printf("admitted %ld rejected %ld started %ld closed %ld\n",
+		admission.n, rejected, start.n, closed);
+	printf("chat sent %ld received %ld stalled %ld\n", sent, fanout.n, stalled);
+	report("admission", &admission);
+	report("start", &start);
+	report("fanout", &fanout);
+	return 0;
+}
+
+/* a player's inventory file, its first line (the name) is */
+/* dropped since every simulated player sends his own */
+void read_inventory(char *fname) {
+	FILE *fp;
+	long len;		// file's length (bytes)
+	char *nl;		// end of the name line
+
+	if ((fp = fopen(fname, "r")) == NULL) {
+		perror("File does not exist\nerrno"); exit(1);	// debugging
+	}
+	fseek(fp, 0, SEEK_END);	// set position indicator to EOF
+	len = ftell(fp);	// total chars
+	rewind(fp);		// set position indicator to beginning
+	if (len > PROTO_MAX - MAX) {
+		len = PROTO_MAX - MAX;	// the request is one message
+	}
+	if (!(inv[ninv] = calloc(len + 1, 1))) {
+		perror("calloc()\nerrno"); exit(1);	// debugging
+	}
+	len = fread(inv[ninv], 1, len, fp);
+	fclose(fp);
+	if ((nl = strchr(inv[ninv], '\n'))) {
+		memmove(inv[ninv], nl + 1, strlen(nl + 1) + 1);
+	}
+	ninv++;
+}
+
+/* connects player p and sends "lg<p>" and his inventory */
+void join_player(int p) {
+	struct epoll_event ev;		// epoll event
+	player_t *pl = &players[p];
+	char *req;		// player's request
+	int len;		// request's length
+
+	pl->joined = now_ns();	// connect time counts too
+	if ((pl->fd = net_connect(server_name)) == -1) {
+		perror("connect()\nerrno"); exit(1);	// debugging
+	}
+	fcntl(pl->fd, F_SETFL, fcntl(pl->fd, F_GETFL) | O_NONBLOCK);
+
+	if (!(req = malloc(PROTO_MAX))) {
+		perror("malloc()\nerrno"); exit(1);	// debugging
+	}
+	len = snprintf(req, PROTO_MAX, "lg%d\n%s", p, inv[p % ninv]);
+	if (len > PROTO_MAX) len = PROTO_MAX;
+	proto_send(pl->fd, MSG_JOIN, req, len, 0);
+	free(req);
+	pl->state = LG_JOIN;
+
+	ev.events = EPOLLIN;
+	ev.data.u32 = p;
+	if (epoll_ctl(epfd, EPOLL_CTL_ADD, pl->fd, &ev) == -1) {
+		perror("epoll_ctl()\nerrno"); exit(1);	// debugging
+	}
+}
+
+void player_event(int p) {
+	player_t *pl = &players[p];
+	char *text, *mark;	// server's message, our time stamp
+	size_t len;		// message's length
+	int type;		// message type
+	long now;		// when it was read (ns)
+	ssize_t n;		// bytes read
+
+	do {
+		n = proto_read(pl->fd, &pl->in);
+	} while (n > 0);
+	now = now_ns();
+
+	while (proto_next(&pl->in, &type, &text, &len)) {
+		switch (type) {
+		case MSG_OK:
+			add_sample(&admission, now - pl->joined);
+			pl->state = LG_WAIT;
+			break;
+		case MSG_REJECT:
+			rejected++;
+			pl->state = LG_DONE;
+			break;
+		case MSG_START:
+			add_sample(&start, now - pl->joined);
+			pl->state = LG_PLAY;
+			/* spread the first messages over one period */
+			pl->next_chat = chat_rate > 0 ?
+				now + (long) (drand48() * 1e9 / chat_rate) : 0;
+			break;
+		case MSG_CHAT:	// "lg<q> : lg <ns>\n"
+			mark = memmem(text, len, " : lg ", 6);
+			if (mark) {
+				add_sample(&fanout, now - strtol(mark + 6, NULL, 10));
+			}
+			break;
+		}
+	}
+
+	if (n == 0 || (n == -1 && errno != EAGAIN && errno != EINTR)) {
+		if (pl->state != LG_DONE) {
+			closed++;	// the server hung up on us
+		}
+		pl->state = LG_DONE;
+		epoll_ctl(epfd, EPOLL_CTL_DEL, pl->fd, NULL);
+		close(pl->fd);
+		proto_free(&pl->in);
+	}
+}
+
+void poll_events(int ms) {
+	struct epoll_event events[MAXEVENTS];	// epoll events
+	int i, n;
+
+	if ((n = epoll_wait(epfd, events, MAXEVENTS, ms)) == -1) {
+		if (errno == EINTR) return;
+		perror("epoll_wait()\nerrno"); exit(1);	// debugging
+	}
+	for (i=0; i<n; i++) {
+		player_event(events[i].data.u32);
+	}
+}
+
+/* every player in a game sends a time stamp when it is due */
+void chat_round(long now) {
+	char mes[64];		// chat message
+	int p, len;
+
+	if (chat_rate <= 0) {
+		return;
+	}
+	for (p=0; p<nplayers; p++) {
+		if (players[p].state != LG_PLAY || now < players[p].next_chat) {
+			continue;
+		}
+		len = snprintf(mes, sizeof(mes), "lg %ld\n", now_ns());
+		if (proto_send(players[p].fd, MSG_CHAT, mes, len, 0) == 0) {
+			sent++;
+		}
+		else {
+			stalled++;	// socket full, the server is behind
+		}
+		players[p].next_chat += 1e9 / chat_rate;
+		if (players[p].next_chat < now) {
+			players[p].next_chat = now;	// never catch up in a burst
+		}
+	}
+}
+
+void add_sample(samples_t *s, long v) {
+	if (s->n == s->size) {
+		s->size = s->size ? 2 * s->size : 1024;
+		if (!(s->v = realloc(s->v, s->size * sizeof(long)))) {
+			perror("realloc()\nerrno"); exit(1);	// debugging
+		}
+	}
+	s->v[s->n++] = v;
+}
+
+/* one line per kind, easy to grep: name n p50 p90 p99 max (us) */
+void report(char *name, samples_t *s) {
+	if (!s->n) {
+		printf("%-10s n=0\n", name);
+		return;
+	}
+	qsort(s->v, s->n, sizeof(long), cmp_long);
+	printf("%-10s n=%ld p50=%ld p90=%ld p99=%ld max=%ld us\n", name, s->n,
+		s->v[s->n * 50 / 100] / 1000, s->v[s->n * 90 / 100] / 1000,
+		s->v[s->n * 99 / 100] / 1000, s->v[s->n - 1] / 1000);
+}
+
+int cmp_long(const void *a, const void *b) {
+	long x = *(const long *) a, y = *(const long *) b;
+
+	return (x > y) - (x < y);
+}
+
+long now_ns() {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}